@@ -11,8 +11,13 @@
 #include "directory.h"
 #include "pathname.h"
 #include "chksumfile.h"
+#include "filestream.h"
 #include <openssl/sha.h>
 
+// Files at least this big are hashed through a filestream, so the next
+// chunk is read while the current one is hashed.
+#define CHKSUMFILE_STREAM_BYTES (128 * 1024)
+
 int chksumblock(const struct unixfilesystem *fs, char buf[], int len, char *chksum_str) {
     SHA_CTX shactx;
     if (!SHA1_Init(&shactx)) {
@@ -34,6 +39,35 @@ int chksumblock(const struct unixfilesystem *fs, char buf[], int len, char *chks
     return 0;
 }
 
+/* Hashes the whole file inumber, open as fp, into shactx through a
+   filestream.  Returns 0 on success, -2 if the file can't be read (with
+   the failing block number stored at *errorBlock), or -3 on any other
+   error.
+ */
+static int chksumfile_stream(const struct unixfilesystem *fs, int inumber,
+                             struct file *fp, SHA_CTX *shactx, int *errorBlock) {
+    struct filestream *st = filestream_open_file(fs, inumber, fp, 0, 0);
+    if (st == NULL) {
+        return -3;
+    }
+
+    int result = 0;
+    struct filestream_chunk chunk;
+    int got;
+    while ((got = filestream_next(st, &chunk)) > 0) {
+        if (!SHA1_Update(shactx, chunk.data, chunk.len)) {
+            result = -3;
+            break;
+        }
+    }
+    if (got < 0) {
+        *errorBlock = chunk.offset / DISKIMG_SECTOR_SIZE;
+        result = -2;
+    }
+    filestream_close(st);
+    return result;
+}
+
 int chksumfile_byinumber_error_checking(const struct unixfilesystem *fs, int inumber, void *chksum, int *filegetblock_error_param) {
     SHA_CTX shactx;
     if (!SHA1_Init(&shactx)) {
@@ -41,31 +75,48 @@ int chksumfile_byinumber_error_checking(const struct unixfilesystem *fs, int inu
         return -3;
     }
 
-    struct inode in;
-    int err = inode_iget(fs, inumber, &in);
-    if (err < 0) {
+    struct file *fp = file_open(fs, inumber);
+    if (fp == NULL) {
         return -1;
     }
 
-    if (!(in.i_mode & IALLOC)) {
+    if (!(file_getinode(fp)->i_mode & IALLOC)) {
         // The inode isn't allocated, so we can't hash it.
+        file_close(fp);
         return -3;
     }
 
-    int size = inode_getsize(&in);
+    int size = file_getsize(fp);
+    if (size >= CHKSUMFILE_STREAM_BYTES) {
+        int result = chksumfile_stream(fs, inumber, fp, &shactx, filegetblock_error_param);
+        file_close(fp);
+        if (result < 0) {
+            return result;
+        }
+        if (!SHA1_Final(chksum, &shactx))
+            return -3;
+        return SHA_DIGEST_LENGTH;
+    }
+
     for (int offset = 0; offset < size; offset += DISKIMG_SECTOR_SIZE) {
-        char buf[DISKIMG_SECTOR_SIZE];
+        const void *data;
         int bno = offset/DISKIMG_SECTOR_SIZE;
 
-        int bytesMoved = file_getblock(fs, inumber, bno, buf);
+        int bytesMoved = file_handle_getblock_ref(fp, bno, &data);
         if (bytesMoved < 0) {
             *filegetblock_error_param = bno;
+            file_close(fp);
             return -2;
         }
 
-        if (!SHA1_Update(&shactx, buf, bytesMoved))
+        int ok = SHA1_Update(&shactx, data, bytesMoved);
+        file_releaseblock_ref(fs, data);
+        if (!ok) {
+            file_close(fp);
             return -3;
+        }
     }
+    file_close(fp);
 
     if (!SHA1_Final(chksum, &shactx))
         return -3;
@@ -80,29 +131,47 @@ int chksumfile_byinumber(const struct unixfilesystem *fs, int inumber, void *chk
         return -1;
     }
 
-    struct inode in;
-    int err = inode_iget(fs, inumber, &in);
-    if (err < 0) {
-        return err;
+    struct file *fp = file_open(fs, inumber);
+    if (fp == NULL) {
+        return -1;
     }
 
-    if (!(in.i_mode & IALLOC)) {
+    if (!(file_getinode(fp)->i_mode & IALLOC)) {
         // The inode isn't allocated, so we can't hash it.
+        file_close(fp);
         return -1;
     }
 
-    int size = inode_getsize(&in);
+    int size = file_getsize(fp);
+    if (size >= CHKSUMFILE_STREAM_BYTES) {
+        int errorBlock;
+        int result = chksumfile_stream(fs, inumber, fp, &shactx, &errorBlock);
+        file_close(fp);
+        if (result < 0)
+            return -1;
+        if (!SHA1_Final(chksum, &shactx))
+            return -1;
+        return SHA_DIGEST_LENGTH;
+    }
+
     for (int offset = 0; offset < size; offset += DISKIMG_SECTOR_SIZE) {
-        char buf[DISKIMG_SECTOR_SIZE];
+        const void *data;
         int bno = offset/DISKIMG_SECTOR_SIZE;
 
-        int bytesMoved = file_getblock(fs, inumber, bno, buf);
-        if (bytesMoved < 0)
+        int bytesMoved = file_handle_getblock_ref(fp, bno, &data);
+        if (bytesMoved < 0) {
+            file_close(fp);
             return -1;
+        }
 
-        if (!SHA1_Update(&shactx, buf, bytesMoved))
+        int ok = SHA1_Update(&shactx, data, bytesMoved);
+        file_releaseblock_ref(fs, data);
+        if (!ok) {
+            file_close(fp);
             return -1;
+        }
     }
+    file_close(fp);
 
     if (!SHA1_Final(chksum, &shactx))
         return -1;
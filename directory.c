@@ -3,40 +3,402 @@
 #include "inode.h"
 #include "diskimg.h"
 #include "file.h"
+#include "lru.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static const int DIRENTS_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(struct direntv6);
 
+/* A directory's entries hashed by name, as kept in fs->dirIndexCache.
+   Only the first entry with each name is kept, since that's the one a
+   scan finds.  buckets holds entry index + 1, or 0 for an empty bucket.
+   inode is the copy it was built from, so a changed directory is noticed.
+ */
+struct directory_index {
+    struct inode inode;
+    int numEntries;
+    uint32_t mask;              // number of buckets - 1
+    struct direntv6 *entries;
+    int32_t *buckets;
+};
+
+/* Returns the length of a name as strncmp with MAX_COMPONENT_LENGTH sees
+   it: up to the first NUL, or MAX_COMPONENT_LENGTH.
+ */
+int directory_namelen(const char *name) {
+    int len = 0;
+    while (len < MAX_COMPONENT_LENGTH && name[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+/* Returns the length of an entry's name the same way.  With SSE2 the whole
+   16-byte entry is compared with zero at once.
+ */
+int directory_entnamelen(const struct direntv6 *ent) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i *) ent);
+    unsigned int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    // bit MAX_COMPONENT_LENGTH stands in for the NUL a full-length name lacks
+    zeros = (zeros >> offsetof(struct direntv6, d_name)) | (1u << MAX_COMPONENT_LENGTH);
+    return __builtin_ctz(zeros);
+#else
+    return directory_namelen(ent->d_name);
+#endif
+}
+
+/* Returns the index of the first of count entries whose name matches name
+   as strncmp with MAX_COMPONENT_LENGTH would, or -1 if none does.  With
+   SSE2 each entry takes one 16-byte compare against the padded name,
+   masked to the name's bytes and the NUL that ends a shorter name.
+ */
+static int directory_matchblock(const struct direntv6 *entries, int count,
+                                const char *name) {
+#ifdef __SSE2__
+    int len = directory_namelen(name);
+    struct direntv6 want;
+    memset(&want, 0, sizeof(want));
+    memcpy(want.d_name, name, len);
+    __m128i target = _mm_loadu_si128((const __m128i *) &want);
+    int compared = len < MAX_COMPONENT_LENGTH ? len + 1 : MAX_COMPONENT_LENGTH;
+    unsigned int need = ((1u << compared) - 1) << offsetof(struct direntv6, d_name);
+    for (int j = 0; j < count; j++) {
+        __m128i ent = _mm_loadu_si128((const __m128i *) &entries[j]);
+        unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(ent, target));
+        if ((equal & need) == need) {
+            return j;
+        }
+    }
+#else
+    for (int j = 0; j < count; j++) {
+        if (strncmp(name, entries[j].d_name, MAX_COMPONENT_LENGTH) == 0) {
+            return j;
+        }
+    }
+#endif
+    return -1;
+}
+
+/* FNV-1a hash of the first len bytes of name. */
+static uint32_t directory_hash(const char *name, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Returns the bucket holding the entry named name (len bytes), or the
+   empty bucket where it would go.
+ */
+static int32_t *directory_probe(const struct directory_index *index,
+                                const char *name, int len) {
+    uint32_t b = directory_hash(name, len) & index->mask;
+    for (;;) {
+        int32_t *bucket = &index->buckets[b];
+        if (*bucket == 0) {
+            return bucket;
+        }
+        const struct direntv6 *ent = &index->entries[*bucket - 1];
+        if (directory_entnamelen(ent) == len && memcmp(ent->d_name, name, len) == 0) {
+            return bucket;
+        }
+        b = (b + 1) & index->mask;
+    }
+}
+
+/* Builds the index of an open directory.  Returns NULL if a block can't be
+   read or memory runs out.
+ */
+static struct directory_index *directory_buildindex(struct file *fp) {
+    int maxEntries = (file_getsize(fp) + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE
+                     * DIRENTS_PER_BLOCK;
+    uint32_t numBuckets = 16;
+    while (numBuckets < 2 * (uint32_t) maxEntries) {
+        numBuckets *= 2;
+    }
+
+    struct directory_index *index = malloc(sizeof(struct directory_index) +
+                                           maxEntries * sizeof(struct direntv6) +
+                                           numBuckets * sizeof(int32_t));
+    if (index == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    index->inode = *file_getinode(fp);
+    index->numEntries = 0;
+    index->mask = numBuckets - 1;
+    index->entries = (struct direntv6 *) (index + 1);
+    index->buckets = (int32_t *) (index->entries + maxEntries);
+    memset(index->buckets, 0, numBuckets * sizeof(int32_t));
+
+    for (int i = 0; i * DISKIMG_SECTOR_SIZE < file_getsize(fp); i++) {
+        struct direntv6 buf[DIRENTS_PER_BLOCK];
+        int blockSize = file_handle_getblock(fp, i, buf);
+        if (blockSize == -1) {
+            free(index);
+            return NULL;
+        }
+
+        int numDir = blockSize / sizeof(struct direntv6);
+        for (int j = 0; j < numDir; j++) {
+            int len = directory_entnamelen(&buf[j]);
+            int32_t *bucket = directory_probe(index, buf[j].d_name, len);
+            if (*bucket == 0) {
+                index->entries[index->numEntries++] = buf[j];
+                *bucket = index->numEntries;
+            }
+        }
+    }
+    return index;
+}
+
+/* Looks name up in the index of the open directory, building it if it
+   isn't cached or is stale.  Returns 1 if found, 0 if not, or -1 if the
+   index couldn't be built.
+ */
+static int directory_indexlookup(const struct unixfilesystem *fs, struct file *fp,
+                                 int dirinumber, const char *name,
+                                 struct direntv6 *dirEnt) {
+    struct directory_index **slot = lru_lookup(fs->dirIndexCache, &dirinumber,
+                                               sizeof(dirinumber));
+    if (slot != NULL &&
+        memcmp(&(*slot)->inode, file_getinode(fp), offsetof(struct inode, i_atime)) != 0) {
+        // stale: the directory changed since it was indexed
+        lru_release(fs->dirIndexCache, slot);
+        slot = NULL;
+    }
+
+    struct directory_index *index;
+    if (slot != NULL) {
+        index = *slot;
+    } else {
+        index = directory_buildindex(fp);
+        if (index == NULL) {
+            return -1;
+        }
+        int charge = index->numEntries > 0 ? index->numEntries : 1;
+        slot = lru_insert(fs->dirIndexCache, &dirinumber, sizeof(dirinumber),
+                          &index, charge);
+    }
+
+    int len = directory_namelen(name);
+    int32_t *bucket = directory_probe(index, name, len);
+    int found = *bucket != 0;
+    if (found) {
+        *dirEnt = index->entries[*bucket - 1];
+    }
+
+    if (slot != NULL) {
+        lru_release(fs->dirIndexCache, slot);
+    } else {
+        free(index);
+    }
+    return found;
+}
+
 int directory_findname(const struct unixfilesystem *fs, const char *name,
                        int dirinumber, struct direntv6 *dirEnt) {
-    // get inode of directory to get size
-    struct inode inp;
-    if (inode_iget(fs, dirinumber, &inp) != 0) {
-        fprintf(stderr, "Error: Inode read improperly.\n");
+    return directory_lookup(fs, name, dirinumber, dirEnt) == 1 ? 0 : -1;
+}
+
+int directory_lookup(const struct unixfilesystem *fs, const char *name,
+                     int dirinumber, struct direntv6 *dirEnt) {
+    // open the directory once for all of its blocks
+    struct file *fp = file_open(fs, dirinumber);
+    if (fp == NULL) {
         return -1;
     }
 
+    // answer from the directory's name index when we can; if it can't be
+    // built, scan the blocks as far as they can be read
+    if (fs->dirIndexCache != NULL) {
+        int found = directory_indexlookup(fs, fp, dirinumber, name, dirEnt);
+        if (found >= 0) {
+            file_close(fp);
+            return found;
+        }
+    }
+
     // loop through each block index of the directory
-    for (int i = 0; i * DISKIMG_SECTOR_SIZE < inode_getsize(&inp); i++) {
+    for (int i = 0; i * DISKIMG_SECTOR_SIZE < file_getsize(fp); i++) {
         // read in blocks from inode
         struct direntv6 buf[DIRENTS_PER_BLOCK];
-        int blockSize = file_getblock(fs, dirinumber, i, buf);
+        int blockSize = file_handle_getblock(fp, i, buf);
         if (blockSize == -1) {
             fprintf(stderr, "Error getting block at index %d\n", i);
+            file_close(fp);
             return -1;
         }
 
-        // loop through each dirent in block to find matching name
+        // look for a matching name among the block's dirents
         int numDir = blockSize / sizeof(struct direntv6);   // avoid accessing invalid dirents
-        for (int j = 0; j < numDir; j++) {
-            if (strncmp(name, buf[j].d_name, MAX_COMPONENT_LENGTH) == 0) {
-                *dirEnt = buf[j];
-                return 0;
-            }
+        int j = directory_matchblock(buf, numDir, name);
+        if (j >= 0) {
+            *dirEnt = buf[j];
+            file_close(fp);
+            return 1;
         }
     }
 
     // name not found in directory 
-    return -1;
+    file_close(fp);
+    return 0;
+}
+
+/* An open directory.  entries points into the current block, held as a
+   block reference, and next is the index of the entry to look at next.
+ */
+struct directory {
+    const struct unixfilesystem *fs;
+    struct file *fp;
+    int block;
+    const struct direntv6 *entries;
+    int numEntries;
+    int next;
+};
+
+struct directory *directory_open(const struct unixfilesystem *fs, int dirinumber) {
+    struct file *fp = file_open(fs, dirinumber);
+    if (fp == NULL) {
+        return NULL;
+    }
+    const struct inode *in = file_getinode(fp);
+    if ((in->i_mode & IALLOC) == 0 || (in->i_mode & IFMT) != IFDIR) {
+        fprintf(stderr, "Inode %d is not a directory\n", dirinumber);
+        file_close(fp);
+        return NULL;
+    }
+
+    struct directory *dir = malloc(sizeof(struct directory));
+    if (dir == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        file_close(fp);
+        return NULL;
+    }
+    dir->fs = fs;
+    dir->fp = fp;
+    dir->block = -1;
+    dir->entries = NULL;
+    dir->numEntries = 0;
+    dir->next = 0;
+    return dir;
+}
+
+int directory_next(struct directory *dir, const struct direntv6 **dirEnt) {
+    for (;;) {
+        while (dir->next < dir->numEntries) {
+            const struct direntv6 *ent = &dir->entries[dir->next++];
+            if (ent->d_inumber != 0) {
+                *dirEnt = ent;
+                return 1;
+            }
+        }
+
+        // move on to the next block, letting go of this one
+        if (dir->entries != NULL) {
+            file_releaseblock_ref(dir->fs, dir->entries);
+            dir->entries = NULL;
+            dir->numEntries = 0;
+        }
+        if ((dir->block + 1) * DISKIMG_SECTOR_SIZE >= file_getsize(dir->fp)) {
+            return 0;
+        }
+        dir->block++;
+        const void *data;
+        int blockSize = file_handle_getblock_ref(dir->fp, dir->block, &data);
+        if (blockSize < 0) {
+            fprintf(stderr, "Error getting block at index %d\n", dir->block);
+            return -1;
+        }
+        dir->entries = data;
+        dir->numEntries = blockSize / sizeof(struct direntv6);
+        dir->next = 0;
+    }
+}
+
+void directory_close(struct directory *dir) {
+    if (dir == NULL) {
+        return;
+    }
+    if (dir->entries != NULL) {
+        file_releaseblock_ref(dir->fs, dir->entries);
+    }
+    file_close(dir->fp);
+    free(dir);
+}
+
+int directory_list_with_inodes(const struct unixfilesystem *fs, int dirinumber,
+                               struct directory_listentry **entries) {
+    *entries = NULL;
+    struct directory *dir = directory_open(fs, dirinumber);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    // collect the names and inumbers first, growing the list as needed
+    struct directory_listentry *list = NULL;
+    int count = 0;
+    int capacity = 0;
+    const struct direntv6 *dirEnt;
+    int result;
+    while ((result = directory_next(dir, &dirEnt)) == 1) {
+        if (count == capacity) {
+            capacity = capacity == 0 ? DIRENTS_PER_BLOCK : capacity * 2;
+            struct directory_listentry *grown = realloc(list, capacity * sizeof(*list));
+            if (grown == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                result = -1;
+                break;
+            }
+            list = grown;
+        }
+        strncpy(list[count].name, dirEnt->d_name, MAX_COMPONENT_LENGTH);
+        list[count].name[MAX_COMPONENT_LENGTH] = '\0';
+        list[count].inumber = dirEnt->d_inumber;
+        count++;
+    }
+    directory_close(dir);
+
+    int *inumbers = NULL;
+    struct inode *inodes = NULL;
+    if (result == 0 && count > 0) {
+        inumbers = malloc(count * sizeof(int));
+        inodes = malloc(count * sizeof(struct inode));
+        if (inumbers == NULL || inodes == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        free(inumbers);
+        free(inodes);
+        free(list);
+        return -1;
+    }
+
+    // then fetch the inodes a block at a time
+    for (int i = 0; i < count; i++) {
+        inumbers[i] = list[i].inumber;
+    }
+    result = inode_iget_many(fs, inumbers, count, inodes);
+    for (int i = 0; i < count; i++) {
+        list[i].inode = inodes[i];
+    }
+    free(inumbers);
+    free(inodes);
+    if (result < 0) {
+        fprintf(stderr, "Error reading the inodes of directory %d\n", dirinumber);
+        free(list);
+        return -1;
+    }
+    *entries = list;
+    return count;
 }
@@ -18,4 +18,68 @@
 int directory_findname(const struct unixfilesystem *fs, const char *name,
                        int dirinumber, struct direntv6 *dirEnt);
 
+/**
+ * Like directory_findname, but tells a missing name apart from an error:
+ * returns 1 if the name was found (and stored at *dirEnt), 0 if the
+ * directory doesn't contain it, or -1 on error.
+ */
+int directory_lookup(const struct unixfilesystem *fs, const char *name,
+                     int dirinumber, struct direntv6 *dirEnt);
+
+/**
+ * Returns the length of name as directory_findname compares it: up to the
+ * first NUL, or MAX_COMPONENT_LENGTH.
+ */
+int directory_namelen(const char *name);
+
+/**
+ * Returns the length of the name in directory entry ent the same way.
+ */
+int directory_entnamelen(const struct direntv6 *ent);
+
+/**
+ * An open directory being read entry by entry.
+ */
+struct directory;
+
+/**
+ * Opens the directory dirinumber for reading with directory_next.  Returns
+ * NULL if the inode can't be read or isn't an allocated directory.
+ */
+struct directory *directory_open(const struct unixfilesystem *fs, int dirinumber);
+
+/**
+ * Advances to the next entry of the directory, skipping empty slots
+ * (d_inumber 0), and stores a pointer to it at *dirEnt.  The entry is
+ * read in place from the directory's current block and stays valid until
+ * the next call or directory_close.  Returns 1 if an entry was stored, 0
+ * at the end of the directory, or -1 if a block can't be read.
+ */
+int directory_next(struct directory *dir, const struct direntv6 **dirEnt);
+
+/**
+ * Closes a directory opened with directory_open.
+ */
+void directory_close(struct directory *dir);
+
+/**
+ * One entry of a directory listing, with its inode.
+ */
+struct directory_listentry {
+    char name[MAX_COMPONENT_LENGTH + 1];    // NUL-terminated
+    int inumber;
+    struct inode inode;
+};
+
+/**
+ * Lists the entries of directory dirinumber, in directory order and
+ * skipping empty slots, together with the inode of each, and stores a
+ * malloc'd array of them at *entries for the caller to free.  The inodes
+ * are fetched with inode_iget_many, so each inode block is read once.
+ * Returns the number of entries, or -1 if the directory or any of the
+ * inodes can't be read.
+ */
+int directory_list_with_inodes(const struct unixfilesystem *fs, int dirinumber,
+                               struct directory_listentry **entries);
+
 #endif // _DIRECTORY_H_
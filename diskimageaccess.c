@@ -31,6 +31,8 @@
 #include "directory.h"
 #include "pathname.h"
 #include "chksumfile.h"
+#include "export.h"
+#include "inodesnapshot.h"
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -243,6 +245,81 @@ static void test_inode_iget(const struct unixfilesystem *fs, const char *arg) {
 }
 
 
+/***** TESTING INODE_FOREACH_ALLOCATED *****/
+
+
+struct foreach_check {
+  const struct unixfilesystem *fs;
+  int lastInumber;      // last inumber visited, 0 before the first
+  int visited;
+  int mismatches;
+};
+
+/* Function: foreach_check_skipped
+ * -------------------------------
+ * This function checks with inode_iget that every inode after the last
+ * one visited and before inumber, which inode_foreach_allocated skipped,
+ * is free.
+ */
+static void foreach_check_skipped(struct foreach_check *check, int inumber) {
+  for (int skipped = check->lastInumber + 1; skipped < inumber; skipped++) {
+    struct inode in;
+    if (inode_iget(check->fs, skipped, &in) < 0 || (in.i_mode & IALLOC) != 0) {
+      printf("\t->ERROR: inode %d was skipped, but inode_iget doesn't report it free\n", skipped);
+      check->mismatches++;
+    }
+  }
+}
+
+/* Function: foreach_check_visit
+ * -----------------------------
+ * Callback for inode_foreach_allocated that prints one visited inode and
+ * checks it, and the inodes skipped before it, against inode_iget.
+ */
+static int foreach_check_visit(int inumber, const struct inode *inp, void *arg) {
+  struct foreach_check *check = arg;
+  foreach_check_skipped(check, inumber);
+  check->lastInumber = inumber;
+  check->visited++;
+
+  struct inode visited = *inp;
+  printf("Inode %d mode 0x%x size %d\n", inumber, visited.i_mode, inode_getsize(&visited));
+  struct inode in;
+  if (inode_iget(check->fs, inumber, &in) < 0 || memcmp(&in, &visited, sizeof(in)) != 0) {
+    printf("\t->ERROR: inode %d doesn't match what inode_iget returns\n", inumber);
+    check->mismatches++;
+  }
+  return 0;
+}
+
+/* Function: test_inode_foreach_allocated
+ * ----------------------------------
+ * This function handles all testing for inode_foreach_allocated; it
+ * expects the string "test1" as its argument.  It visits every allocated
+ * inode on the disk with inode_foreach_allocated, printing each, and
+ * checks every inode, visited or skipped, against inode_iget.
+ */
+static void test_inode_foreach_allocated(const struct unixfilesystem *fs, const char *arg) {
+  if (strcmp(arg, "test1") != 0) {
+    printf("ERROR: inode_foreach_allocated only supports \"test1\"\n");
+    return;
+  }
+
+  int max_inode_number = fs->superblock.s_isize * INODES_PER_BLOCK;
+  printf("test1: visiting all allocated inodes on this disk (%d inodes total)\n\n",
+    max_inode_number);
+  struct foreach_check check = { fs, 0, 0, 0 };
+  int result = inode_foreach_allocated(fs, foreach_check_visit, &check);
+  if (result < 0) {
+    printf("inode_foreach_allocated returned %d\n", result);
+    return;
+  }
+  foreach_check_skipped(&check, max_inode_number + 1);
+  printf("\nVisited %d inodes; %s\n", check.visited,
+    check.mismatches == 0 ? "all match inode_iget" : "MISMATCH with inode_iget");
+}
+
+
 /***** TESTING INODE_INDEXLOOKUP *****/
 
 
@@ -334,12 +411,13 @@ static void test_inode_indexlookup(const struct unixfilesystem *fs, const char *
       test_inode_indexlookup_custom(fs2, 5, 10000);
     }
 
-    // Close the disk image when we're done
+    // Free the filesystem first, which waits for any reads it still has
+    // in flight, then close the disk image
+    unixfilesystem_free(fs2);
     int err = diskimg_close(fd);
     if (err < 0) {
       printf("Error closing %s\n", diskpath);
     }
-    free(fs2);
   } else if (!strcmp(args[0], "test4")) {
     // Uses disk image specified by user
     printf("test4: printing block number info for all allocated inodes on this disk (%d inodes total)\n", 
@@ -459,12 +537,13 @@ static void test_file_getblock(const struct unixfilesystem *fs, const char *args
       test_file_getblock_custom(fs2, 5, 10000);
     }
 
-    // Close the disk image when we're done
+    // Free the filesystem first, which waits for any reads it still has
+    // in flight, then close the disk image
+    unixfilesystem_free(fs2);
     int err = diskimg_close(fd);
     if (err < 0) {
       printf("Error closing %s\n", diskpath);
     }
-    free(fs2);
   } else if (!strcmp(args[0], "test4")) {
     // Uses disk image specified by user
     printf("test4: printing info for all allocated inodes on this disk (%d inodes total)\n", 
@@ -653,18 +732,76 @@ static void test_directory_findname(const struct unixfilesystem *fs, const char
       test_directory_findname_test3(fs2);
     }
 
-    // Close the disk image when we're done
+    // Free the filesystem first, which waits for any reads it still has
+    // in flight, then close the disk image
+    unixfilesystem_free(fs2);
     int err = diskimg_close(fd);
     if (err < 0) {
       printf("Error closing basicDiskImageExtended\n");
     }
-    free(fs2);
   } else {
     // Custom test
     test_directory_findname_custom(fs, atoi(args[0]), args[1]);
   }
 }
 
+/* Function: test_directory_list_custom
+ * ----------------------------------
+ * This function lists directory dirinumber with directory_list_with_inodes,
+ * printing the name, inumber, mode and size of each entry, and checks each
+ * inode in the listing against the one inode_iget reads for that entry.
+ * Returns true if they all match.
+ */
+static bool test_directory_list_custom(const struct unixfilesystem *fs, int dirinumber) {
+  printf("Calling directory_list_with_inodes(%d)\n-----\n", dirinumber);
+  struct directory_listentry *entries;
+  int count = directory_list_with_inodes(fs, dirinumber, &entries);
+  if (count < 0) {
+    printf("directory_list_with_inodes(%d) returned %d\n", dirinumber, count);
+    return false;
+  }
+
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    struct inode in;
+    int result = inode_iget(fs, entries[i].inumber, &in);
+    bool match = result == 0 && memcmp(&in, &entries[i].inode, sizeof(in)) == 0;
+    printf("  %-14s inode %d mode %06o size %d%s\n", entries[i].name,
+      entries[i].inumber, entries[i].inode.i_mode,
+      inode_getsize(&entries[i].inode), match ? "" : " MISMATCH with inode_iget");
+    ok &= match;
+  }
+  printf("%d entries\n\n", count);
+  free(entries);
+  return ok;
+}
+
+/* Function: test_directory_list
+ * ----------------------------------
+ * This function handles all testing for directory_list_with_inodes; it
+ * expects one string argument, which can be either "test1" or a directory
+ * inumber.  If "test1", it lists every allocated directory on the disk;
+ * otherwise it lists the directory with the specified inumber.
+ */
+static void test_directory_list(const struct unixfilesystem *fs, const char *arg) {
+  if (strcmp(arg, "test1") != 0) {
+    test_directory_list_custom(fs, atoi(arg));
+    return;
+  }
+
+  printf("test1: listing every directory on this disk\n\n");
+  bool ok = true;
+  int max_inode_number = fs->superblock.s_isize * 16;
+  for (int inumber = 1; inumber <= max_inode_number; inumber++) {
+    struct inode in;
+    if (inode_iget(fs, inumber, &in) == 0 && (in.i_mode & IALLOC) != 0 &&
+      (in.i_mode & IFMT) == IFDIR) {
+      ok &= test_directory_list_custom(fs, inumber);
+    }
+  }
+  printf("%s\n", ok ? "every listing matches inode_iget" : "MISMATCH between listings and inode_iget");
+}
+
 
 /***** TESTING PATHNAME_LOOKUP *****/
 
@@ -693,48 +830,6 @@ static int test_pathname_lookup_custom(const struct unixfilesystem *fs,
   return result;
 }
 
-/* Function: getDirEntries
- * ----------------------------------
- * This function is taken from diskimageaccess.c.  It fetches as many
- * entries from the specified directory as can fit in the specified array,
- * and returns the number of entries found.
- */
-static int getDirEntries(const struct unixfilesystem *fs, int inumber, struct direntv6 *entries, int maxNumEntries) {
-  struct inode in;
-  int err = inode_iget(fs, inumber, &in);
-  if (err < 0) return err;
-  
-  if (!(in.i_mode & IALLOC) || ((in.i_mode & IFMT) != IFDIR)) {
-    /* Not allocated or not a directory */
-    return -1;
-  }
-
-  if (maxNumEntries < 1) return -1;
-  int size = inode_getsize(&in);
-
-  assert((size % sizeof(struct direntv6)) == 0);
-
-  int count = 0;
-  int numBlocks  = (size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
-  char buf[DISKIMG_SECTOR_SIZE];
-  struct direntv6 *dir = (struct direntv6 *) buf;
-  for (int bno = 0; bno < numBlocks; bno++) {
-    int bytesLeft, numEntriesInBlock, i;
-    bytesLeft = file_getblock(fs, inumber,bno,dir);
-    if (bytesLeft < 0) {
-      printf("Error reading directory\n");
-      return -1;
-    }
-    numEntriesInBlock = bytesLeft/sizeof(struct direntv6); 
-    for (i = 0; i <  numEntriesInBlock ; i++) { 
-      entries[count] = dir[i];
-      count++;
-      if (count >= maxNumEntries) return count;
-    }
-  }
-  return count;
-}
-
 /* Function: dumpPathAndChildren
  * ----------------------------------
  * This function is taken from diskimageaccess.c.  It recursively prints out
@@ -808,10 +903,14 @@ static void dumpPathAndChildren(const struct unixfilesystem *fs, const char *pat
       printf("Too deep of directories %s\n", pathname);
     }
 
-    struct direntv6 direntries[10000];
-    int numentries = getDirEntries(fs, inumber, direntries, 10000);
-    for (int i = 0; i < numentries; i++) {
-      char *n =  direntries[i].d_name;
+    struct directory *dir = directory_open(fs, inumber);
+    if (dir == NULL) {
+      return;
+    }
+    const struct direntv6 *dirent;
+    int result;
+    while ((result = directory_next(dir, &dirent)) == 1) {
+      const char *n = dirent->d_name;
       if (n[0] == '.') {
         if ((n[1] == 0) || ((n[1] == '.') && (n[2] == 0))) {
             /* Skip over "." and ".." */
@@ -819,15 +918,19 @@ static void dumpPathAndChildren(const struct unixfilesystem *fs, const char *pat
         }
       }
 
-        // Account for d_name not having null terminator
-      char d_name[sizeof(direntries[i].d_name) + 1];
-      strncpy(d_name, direntries[i].d_name, sizeof(direntries[i].d_name));
-      d_name[sizeof(direntries[i].d_name)] = '\0';
+      // Account for d_name not having null terminator
+      char d_name[MAX_COMPONENT_LENGTH + 1];
+      strncpy(d_name, dirent->d_name, MAX_COMPONENT_LENGTH);
+      d_name[MAX_COMPONENT_LENGTH] = '\0';
 
       char nextpath[MAXPATH];
       sprintf(nextpath, "%s/%s",pathname, d_name);
-      dumpPathAndChildren(fs, nextpath,  direntries[i].d_inumber);
+      dumpPathAndChildren(fs, nextpath, dirent->d_inumber);
     }
+    if (result < 0) {
+      printf("Error reading directory\n");
+    }
+    directory_close(dir);
   }
 }
 
@@ -862,9 +965,282 @@ static void test_pathname_lookup(const struct unixfilesystem *fs,
   }
 }
 
+/* Function: test_pathname_lookup_many
+ * ----------------------------------
+ * This function handles all testing for pathname_lookup_many; it expects
+ * the path of a host file listing one absolute path per line.  It looks
+ * up every path in one pathname_lookup_many call and prints the inumber
+ * found for each, then checks each result against pathname_lookup on the
+ * same filesystem and on a second one over the same disk image with all
+ * of its caches turned off.
+ */
+static void test_pathname_lookup_many(const struct unixfilesystem *fs, int dfd,
+  const char *listPath) {
+  FILE *list = fopen(listPath, "r");
+  if (list == NULL) {
+    printf("Can't open path list %s: %s\n", listPath, strerror(errno));
+    return;
+  }
+  char **paths = NULL;
+  int numPaths = 0;
+  int capacity = 0;
+  char *line = NULL;
+  size_t lineSize = 0;
+  ssize_t len;
+  while ((len = getline(&line, &lineSize, list)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+    if (numPaths == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      paths = realloc(paths, capacity * sizeof(char *));
+      assert(paths != NULL);
+    }
+    paths[numPaths] = strdup(line);
+    assert(paths[numPaths] != NULL);
+    numPaths++;
+  }
+  free(line);
+  fclose(list);
+
+  struct unixfilesystem_options uncachedOpts;
+  unixfilesystem_default_options(&uncachedOpts);
+  uncachedOpts.cacheSectors = 0;
+  uncachedOpts.readaheadBlocks = 0;
+  uncachedOpts.inodeTable = UNIXFILESYSTEM_INODES_ONDEMAND;
+  uncachedOpts.blockMapEntries = 0;
+  uncachedOpts.dirIndexEntries = 0;
+  uncachedOpts.dentryEntries = 0;
+  uncachedOpts.pathEntries = 0;
+  struct unixfilesystem *uncached = unixfilesystem_init_options(dfd, &uncachedOpts);
+  const char **constPaths = malloc((numPaths > 0 ? numPaths : 1) * sizeof(char *));
+  int *inumbers = malloc((numPaths > 0 ? numPaths : 1) * sizeof(int));
+  assert(uncached != NULL && constPaths != NULL && inumbers != NULL);
+  for (int i = 0; i < numPaths; i++) {
+    constPaths[i] = paths[i];
+  }
+
+  printf("Looking up %d paths with pathname_lookup_many\n\n", numPaths);
+  int result = pathname_lookup_many(fs, constPaths, numPaths, inumbers);
+  if (result < 0) {
+    printf("pathname_lookup_many returned %d\n", result);
+  } else {
+    int mismatches = 0;
+    for (int i = 0; i < numPaths; i++) {
+      printf("%s -> %d\n", paths[i], inumbers[i]);
+      int cachedInumber = pathname_lookup(fs, paths[i]);
+      int uncachedInumber = pathname_lookup(uncached, paths[i]);
+      if (cachedInumber != inumbers[i] || uncachedInumber != inumbers[i]) {
+        printf("\tMISMATCH: pathname_lookup returned %d with caching on, %d with it off\n",
+          cachedInumber, uncachedInumber);
+        mismatches++;
+      }
+    }
+    printf("\n%d of %d paths match pathname_lookup with caching on and off\n",
+      numPaths - mismatches, numPaths);
+  }
+
+  unixfilesystem_free(uncached);
+  free(constPaths);
+  free(inumbers);
+  for (int i = 0; i < numPaths; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+/***** EXPORTING FILES *****/
+
+
+/* Function: print_export_result
+ * ----------------------------------
+ * Report callback for export_tree_options that prints one exported file.
+ */
+static void print_export_result(const char *hostPath, int inumber, int size, int result, void *arg) {
+  printf("  %s inode %d size %d%s\n", hostPath, inumber, size, result == 0 ? "" : " FAILED");
+}
+
+/* Function: test_export
+ * ----------------------------------
+ * This function copies the file or directory tree at the absolute path
+ * args[0] out of the disk image to the host path args[1], using
+ * export_file or export_tree_options with the given number of threads,
+ * and reports how it went.  Directory exports list every file in the
+ * same order for any number of threads.
+ */
+static void test_export(const struct unixfilesystem *fs, const char *args[], int threads) {
+  if (args[1] == NULL) {
+    printf("ERROR: export needs a path on the disk and a host path\n");
+    return;
+  }
+
+  int inumber = pathname_lookup(fs, args[0]);
+  if (inumber < 0) {
+    printf("pathname_lookup(%s) returned %d\n", args[0], inumber);
+    return;
+  }
+  struct inode in;
+  if (inode_iget(fs, inumber, &in) < 0) {
+    printf("inode_iget(%d) returned < 0\n", inumber);
+    return;
+  }
+
+  if ((in.i_mode & IFMT) == IFDIR) {
+    struct export_options opts;
+    export_default_options(&opts);
+    opts.threads = threads;
+    opts.report = print_export_result;
+    int count = export_tree_options(fs, inumber, args[1], &opts);
+    printf("export_tree(%s -> %s) returned %d\n", args[0], args[1], count);
+  } else {
+    int result = export_file(fs, inumber, args[1]);
+    printf("export_file(%s -> %s) returned %d\n", args[0], args[1], result);
+  }
+}
+
+/* Function: check_snapshot_query
+ * ----------------------------------
+ * This function counts the regular files owned by uid that are at least
+ * minSize bytes long, and adds up their sizes, using the inode snapshot.
+ * It prints the result, then repeats the query with a plain inode_iget
+ * loop over every inode and reports any inode the two disagree on.
+ * Returns true if they agree.
+ */
+static bool check_snapshot_query(const struct unixfilesystem *fs,
+  const struct inodesnapshot *snap, int uid, int minSize) {
+  uint64_t *sel = inodesnapshot_select_allocated(snap);
+  if (sel == NULL) {
+    printf("inodesnapshot_select_allocated returned NULL\n");
+    return false;
+  }
+  inodesnapshot_filter_mode(snap, IFMT, 0, sel);
+  inodesnapshot_filter_uid(snap, uid, sel);
+  inodesnapshot_filter_size(snap, minSize, INT32_MAX, sel);
+  int count = inodesnapshot_count(snap, sel);
+  uint64_t total = inodesnapshot_sumsize(snap, sel);
+  printf("regular files with uid %d and size >= %d: %d files, %llu bytes\n",
+    uid, minSize, count, (unsigned long long) total);
+
+  bool ok = true;
+  int loopCount = 0;
+  uint64_t loopTotal = 0;
+  int next = inodesnapshot_next(snap, sel, 0);
+  for (int inumber = 1; inumber <= snap->count; inumber++) {
+    struct inode in;
+    if (inode_iget(fs, inumber, &in) < 0) {
+      printf("\tinode_iget(%d) returned < 0\n", inumber);
+      ok = false;
+      continue;
+    }
+    int size = inode_getsize(&in);
+    bool match = (in.i_mode & IALLOC) != 0 && (in.i_mode & IFMT) == 0 &&
+      in.i_uid == uid && size >= minSize;
+    if (match) {
+      loopCount++;
+      loopTotal += size;
+    }
+    if (match != (next == inumber)) {
+      printf("\tinode %d: inode_iget %s, snapshot %s\n", inumber,
+        match ? "matches" : "doesn't match",
+        next == inumber ? "selects it" : "doesn't select it");
+      ok = false;
+    }
+    if (next == inumber) {
+      next = inodesnapshot_next(snap, sel, inumber);
+    }
+  }
+  if (loopCount != count || loopTotal != total) {
+    printf("\tinode_iget loop found %d files, %llu bytes\n", loopCount,
+      (unsigned long long) loopTotal);
+    ok = false;
+  }
+  free(sel);
+  return ok;
+}
+
+/* Function: test_inodesnapshot
+ * ----------------------------------
+ * This function handles all testing for inodesnapshot; it expects either
+ * the string "test1" or a uid followed by a minimum size.  If "test1",
+ * it runs the query in check_snapshot_query for every uid that owns an
+ * allocated inode, with minimum sizes of 0 and 4096 bytes.  Otherwise it
+ * runs the query once with the specified uid and minimum size.
+ */
+static void test_inodesnapshot(const struct unixfilesystem *fs, const char *args[]) {
+  struct inodesnapshot *snap = inodesnapshot_create(fs);
+  if (snap == NULL) {
+    printf("inodesnapshot_create returned NULL\n");
+    return;
+  }
+
+  bool ok = true;
+  if (strcmp(args[0], "test1") != 0) {
+    if (args[1] == NULL) {
+      printf("ERROR: inodesnapshot needs a uid and a minimum size\n");
+      inodesnapshot_free(snap);
+      return;
+    }
+    ok = check_snapshot_query(fs, snap, atoi(args[0]), atoi(args[1]));
+  } else {
+    bool owners[256] = { false };
+    for (int inumber = 1; inumber <= snap->count; inumber++) {
+      struct inode in;
+      if (inode_iget(fs, inumber, &in) == 0 && (in.i_mode & IALLOC) != 0) {
+        owners[in.i_uid] = true;
+      }
+    }
+    for (int uid = 0; uid < 256; uid++) {
+      if (owners[uid]) {
+        ok &= check_snapshot_query(fs, snap, uid, 0);
+        ok &= check_snapshot_query(fs, snap, uid, 4096);
+      }
+    }
+  }
+  printf("%s\n", ok ? "snapshot matches inode_iget" : "MISMATCH between snapshot and inode_iget");
+  inodesnapshot_free(snap);
+}
+
+/* Function: print_io_stats
+ * -------------------------
+ * This function prints the I/O counters diskimg kept for the specified disk
+ * image, followed by a latency histogram for each kind of operation that
+ * was used.
+ */
+static void print_io_stats(int dfd) {
+  struct diskimg_stats stats;
+  if (diskimg_getstats(dfd, &stats) != 0) {
+    printf("\nNo I/O statistics available.\n");
+    return;
+  }
+
+  printf("\nI/O statistics:\n");
+  printf("  sectors read     %llu\n", (unsigned long long) stats.sectorsRead);
+  printf("  sectors written  %llu\n", (unsigned long long) stats.sectorsWritten);
+  printf("  bytes read       %llu\n", (unsigned long long) stats.bytesRead);
+  printf("  bytes written    %llu\n", (unsigned long long) stats.bytesWritten);
+  printf("  syscalls         %llu\n", (unsigned long long) stats.syscalls);
+  printf("  cache hits       %llu\n", (unsigned long long) stats.cacheHits);
+  printf("  cache misses     %llu\n", (unsigned long long) stats.cacheMisses);
+
+  const char *opNames[DISKIMG_NUM_OPS] = { "read", "readv", "write", "aio" };
+  for (int op = 0; op < DISKIMG_NUM_OPS; op++) {
+    if (stats.ops[op] == 0) {
+      continue;
+    }
+    printf("  %s: %llu ops, latency (ns):\n", opNames[op],
+      (unsigned long long) stats.ops[op]);
+    for (int b = 0; b < DISKIMG_LATENCY_BUCKETS; b++) {
+      if (stats.latency[op][b] != 0) {
+        printf("    [%llu, %llu)\t%llu\n", 1ULL << b, 1ULL << (b + 1),
+          (unsigned long long) stats.latency[op][b]);
+      }
+    }
+  }
+}
+
 static void printUsage(const char *progname) {
   printf("Usage: %s <options?> <diskimagePath> <function> <arg1>...<argn>\n\n", progname);
-  printf("<options?> is optionally one of:\n");
+  printf("<options?> is zero or more of:\n");
   printf("-h               Print this message and exit.\n");
   printf("--help           Print this message and exit.\n");
   printf("--redirect-err   Redirect stderr to a file so it won't appear in\n");
@@ -872,6 +1248,20 @@ static void printUsage(const char *progname) {
   printf("                 the file is non-empty after running the test(s).\n");
   printf("                 Used to check whether an error messsage is printed,\n");
   printf("                 without being sensitive to the exact message text.\n");
+  printf("--mmap           Memory-map the disk image instead of reading it\n");
+  printf("                 one sector at a time through the file descriptor.\n");
+  printf("--offset=N       The filesystem starts N bytes into the image file\n");
+  printf("                 (e.g. one partition of a larger container image).\n");
+  printf("--length=N       The filesystem is N bytes long (default: to the\n");
+  printf("                 end of the image file).\n");
+  printf("--stats          Print I/O counters and latency histograms for the\n");
+  printf("                 disk image after running the test(s).\n");
+  printf("--cache=N        Keep up to N recently read sectors in memory\n");
+  printf("                 (0 turns the sector cache off).\n");
+  printf("--threads=N      Use N threads for export (default 1).\n");
+  printf("--inode-table=eager  Load the whole inode table into memory up front.\n");
+  printf("--inode-table=lazy   Load the inode table into memory in chunks,\n");
+  printf("                 as inodes are first used.\n");
   printf("<diskimagePath> is the path to a disk image file\n");
   printf("                 (e.g. ones in samples/disk_images).\n");
   printf("<function> is one of the assignment functions, e.g.\n");
@@ -885,6 +1275,10 @@ static void printUsage(const char *progname) {
   printf("                 - specify \"test1\" as arg to test inode_iget\n");
   printf("                   on all inodes on the disk\n");
   printf("                 - otherwise, specify the inode number to test\n");
+  printf("inode_foreach_allocated:\n");
+  printf("                 - specify \"test1\" as arg to visit all allocated\n");
+  printf("                   inodes on the disk, checking them against\n");
+  printf("                   inode_iget\n");
   printf("inode_indexlookup:\n");
   printf("                 - specify \"test1\" as arg to test the first\n");
   printf("                   block of a small file\n");
@@ -916,6 +1310,12 @@ static void printUsage(const char *progname) {
   printf("                   directory_findname on all files on the disk\n");
   printf("                 - otherwise, specify the directory inumber\n");
   printf("                   followed by the entry name to test with\n");
+  printf("directory_list:\n");
+  printf("                 - specify \"test1\" as arg to list every\n");
+  printf("                   directory on the disk with its inodes,\n");
+  printf("                   checking them against inode_iget\n");
+  printf("                 - otherwise, specify the directory inumber\n");
+  printf("                   to list\n");
   printf("pathname_lookup:\n");
   printf("                 - specify \"test1\" as arg to test a path\n");
   printf("                   that's not found\n");
@@ -923,6 +1323,21 @@ static void printUsage(const char *progname) {
   printf("                   pathname_lookup on all files on the disk\n");
   printf("                 - otherwise, specify the absolute path\n");
   printf("                   to test with\n");
+  printf("pathname_lookup_many:\n");
+  printf("                 - specify a host file listing one absolute path\n");
+  printf("                   per line to look them all up at once, checking\n");
+  printf("                   each against pathname_lookup\n");
+  printf("export:\n");
+  printf("                 - specify an absolute path on the disk followed\n");
+  printf("                   by a host path to copy that file, or that\n");
+  printf("                   directory and everything below it, out to\n");
+  printf("                   the host\n");
+  printf("inodesnapshot:\n");
+  printf("                 - specify \"test1\" as arg to count and total\n");
+  printf("                   the regular files of every owner, checking\n");
+  printf("                   the snapshot against inode_iget\n");
+  printf("                 - otherwise, specify a uid followed by a\n");
+  printf("                   minimum file size to test with\n");
 }
 
 int main(int argc, const char *argv[]) {
@@ -937,10 +1352,39 @@ int main(int argc, const char *argv[]) {
     return 0;
   }
 
-  // redirect error messages to file
+  // Parse any leading options
   bool quiet = false;
-  if (strcmp(argv[1], "--redirect-err") == 0) {
-    quiet = true;
+  bool showStats = false;
+  int threads = 1;
+  struct diskimg_options diskopts = {
+    .readOnly = 1,
+    .backend = DISKIMG_BACKEND_FD,
+  };
+  struct unixfilesystem_options fsopts;
+  unixfilesystem_default_options(&fsopts);
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--redirect-err") == 0) {
+      // redirect error messages to file
+      quiet = true;
+    } else if (strcmp(argv[1], "--stats") == 0) {
+      showStats = true;
+    } else if (strcmp(argv[1], "--mmap") == 0) {
+      diskopts.backend = DISKIMG_BACKEND_MMAP;
+    } else if (strncmp(argv[1], "--offset=", 9) == 0) {
+      diskopts.baseOffset = strtoll(argv[1] + 9, NULL, 0);
+    } else if (strncmp(argv[1], "--length=", 9) == 0) {
+      diskopts.length = strtoll(argv[1] + 9, NULL, 0);
+    } else if (strcmp(argv[1], "--inode-table=eager") == 0) {
+      fsopts.inodeTable = UNIXFILESYSTEM_INODES_EAGER;
+    } else if (strcmp(argv[1], "--inode-table=lazy") == 0) {
+      fsopts.inodeTable = UNIXFILESYSTEM_INODES_LAZY;
+    } else if (strncmp(argv[1], "--cache=", 8) == 0) {
+      fsopts.cacheSectors = atoi(argv[1] + 8);
+    } else if (strncmp(argv[1], "--threads=", 10) == 0) {
+      threads = atoi(argv[1] + 10);
+    } else {
+      break;
+    }
     argv++;
     argc--;
   }
@@ -953,12 +1397,12 @@ int main(int argc, const char *argv[]) {
 
   // First, load the specified disk image
   const char *diskpath = argv[1];
-  int fd = diskimg_open(diskpath, 1);
+  int fd = diskimg_open_options(diskpath, &diskopts);
   if (fd < 0) {
     printf("Can't open diskimagePath %s\n", diskpath);
     return EXIT_FAILURE;
   }
-  struct unixfilesystem *fs = unixfilesystem_init(fd);
+  struct unixfilesystem *fs = unixfilesystem_init_options(fd, &fsopts);
   if (!fs) {
     printf("Failed to initialize unix filesystem\n");
     return EXIT_FAILURE;
@@ -985,25 +1429,40 @@ int main(int argc, const char *argv[]) {
   // Next, identify which function is being tested
   if (strcmp(argv[2], "inode_iget") == 0) {
     test_inode_iget(fs, argv[3]);
+  } else if (strcmp(argv[2], "inode_foreach_allocated") == 0) {
+    test_inode_foreach_allocated(fs, argv[3]);
   } else if (strcmp(argv[2], "inode_indexlookup") == 0) {
       test_inode_indexlookup(fs, argv + 3);
   } else if (strcmp(argv[2], "file_getblock") == 0) {
       test_file_getblock(fs, argv + 3);
   } else if (strcmp(argv[2], "directory_findname") == 0) {
       test_directory_findname(fs, argv + 3);
+  } else if (strcmp(argv[2], "directory_list") == 0) {
+    test_directory_list(fs, argv[3]);
   } else if (strcmp(argv[2], "pathname_lookup") == 0) {
     test_pathname_lookup(fs, argv[3]);
+  } else if (strcmp(argv[2], "pathname_lookup_many") == 0) {
+    test_pathname_lookup_many(fs, fd, argv[3]);
+  } else if (strcmp(argv[2], "export") == 0) {
+    test_export(fs, argv + 3, threads);
+  } else if (strcmp(argv[2], "inodesnapshot") == 0) {
+    test_inodesnapshot(fs, argv + 3);
   } else {
     printf("ERROR: unknown function '%s'.\n", argv[2]);
     error = true;
   }
 
-  // Close the disk image when we're done
+  if (showStats) {
+    print_io_stats(fd);
+  }
+
+  // Free the filesystem first, which waits for any reads it still has
+  // in flight, then close the disk image
+  unixfilesystem_free(fs);
   int err = diskimg_close(fd);
   if (err < 0) {
     printf("Error closing %s\n", argv[1]);
   }
-  free(fs);
 
   // Check if the error file has any output
   if (quiet) {
@@ -1,32 +1,532 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "diskimg.h"
 
+// Largest descriptor we keep backend state for.  Descriptors past this
+// still work, but always use the plain descriptor backend.
+#define DISKIMG_MAX_OPEN 1024
+
+// Bounce buffer used by diskimg_copyout when the kernel can't copy.
+#define DISKIMG_COPY_CHUNK (64 * 1024)
+
+// POSIX limit on iovecs per preadv; only exported by glibc for XOPEN.
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Per-image state, indexed by the descriptor returned from diskimg_open. */
+struct diskimg {
+    int backend;        // DISKIMG_BACKEND_FD or DISKIMG_BACKEND_MMAP
+    off_t base;         // byte offset of sector 0 within the file
+    off_t length;       // bytes of the file past base that belong to the
+                        // image, or -1 for everything to the end
+    uint8_t *map;       // sector 0 within the mapping (mmap backend only)
+    size_t mapSize;     // bytes mapped from sector 0 on
+    void *mapStart;     // page-aligned start of the mapping, for munmap
+    size_t mapLength;
+    struct diskimg_stats stats;     // updated with atomic adds
+};
+
+static struct diskimg *images[DISKIMG_MAX_OPEN];
+
+static struct diskimg *diskimg_lookup(int dfd) {
+    if (dfd < 0 || dfd >= DISKIMG_MAX_OPEN) {
+        return NULL;
+    }
+    return images[dfd];
+}
+
+static uint64_t diskimg_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void diskimg_count(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Maps the image (from base to the end of the region) into memory.
+   Returns 0 on success, or -1 if the region is empty or can't be mapped.
+ */
+static int diskimg_map(int dfd, int readOnly, struct diskimg *img) {
+    struct stat st;
+    if (fstat(dfd, &st) != 0 || st.st_size <= img->base) {
+        return -1;
+    }
+    off_t size = st.st_size - img->base;
+    if (img->length >= 0 && img->length < size) {
+        size = img->length;
+    }
+    if ((uint64_t) size > SIZE_MAX) {
+        return -1;
+    }
+
+    // mmap offsets must be page-aligned, so map from the page holding base.
+    off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t start = img->base - img->base % pageSize;
+    size_t length = size + (img->base - start);
+    int prot = readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, length, prot, MAP_SHARED, dfd, start);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    img->mapStart = map;
+    img->mapLength = length;
+    img->map = (uint8_t *) map + (img->base - start);
+    img->mapSize = size;
+    return 0;
+}
+
+/* Returns how many of the count bytes starting at offset (relative to
+   sector 0) lie inside the image's region.
+ */
+static size_t diskimg_clamp(const struct diskimg *img, off_t offset,
+                            size_t count) {
+    if (img == NULL || img->length < 0) {
+        return count;
+    }
+    if (offset >= img->length) {
+        return 0;
+    }
+    if ((uint64_t) count > (uint64_t) (img->length - offset)) {
+        return img->length - offset;
+    }
+    return count;
+}
+
 int diskimg_open(const char *pathname, int readOnly) {
-    return open(pathname, readOnly ? O_RDONLY : O_RDWR);
+    return diskimg_open_backend(pathname, readOnly, DISKIMG_BACKEND_FD);
+}
+
+int diskimg_open_backend(const char *pathname, int readOnly, int backend) {
+    struct diskimg_options opts = {
+        .readOnly = readOnly,
+        .backend = backend,
+        .baseOffset = 0,
+        .length = 0,
+    };
+    return diskimg_open_options(pathname, &opts);
+}
+
+int diskimg_open_options(const char *pathname,
+                         const struct diskimg_options *opts) {
+    if (opts->baseOffset < 0 || opts->length < 0) {
+        return -1;
+    }
+
+    int dfd = open(pathname, opts->readOnly ? O_RDONLY : O_RDWR);
+    if (dfd < 0) {
+        return dfd;
+    }
+    if (dfd >= DISKIMG_MAX_OPEN) {
+        // No room to remember where the image starts.
+        if (opts->baseOffset != 0 || opts->length != 0) {
+            close(dfd);
+            return -1;
+        }
+        return dfd;
+    }
+
+    struct diskimg *img = calloc(1, sizeof(struct diskimg));
+    if (img == NULL) {
+        close(dfd);
+        return -1;
+    }
+
+    img->backend = DISKIMG_BACKEND_FD;
+    img->base = opts->baseOffset;
+    img->length = opts->length > 0 ? opts->length : -1;
+    if (opts->backend == DISKIMG_BACKEND_MMAP &&
+        diskimg_map(dfd, opts->readOnly, img) == 0) {
+        img->backend = DISKIMG_BACKEND_MMAP;
+    }
+
+    images[dfd] = img;
+    return dfd;
+}
+
+int diskimg_getbackend(int dfd) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    return img == NULL ? DISKIMG_BACKEND_FD : img->backend;
+}
+
+off_t diskimg_getbaseoffset(int dfd) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    return img == NULL ? 0 : img->base;
+}
+
+off_t diskimg_getsize(int dfd) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    off_t end = lseek(dfd, 0, SEEK_END);
+    if (end < 0 || img == NULL) {
+        return end;
+    }
+
+    off_t size = end > img->base ? end - img->base : 0;
+    if (img->length >= 0 && img->length < size) {
+        size = img->length;
+    }
+    return size;
+}
+
+size_t diskimg_clampread(int dfd, off_t offset, size_t count) {
+    return diskimg_clamp(diskimg_lookup(dfd), offset, count);
+}
+
+const void *diskimg_getsectorptr(int dfd, int sectorNum) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img == NULL || img->backend != DISKIMG_BACKEND_MMAP || sectorNum < 0) {
+        return NULL;
+    }
+
+    uint64_t offset = (uint64_t) sectorNum * DISKIMG_SECTOR_SIZE;
+    if (offset + DISKIMG_SECTOR_SIZE > img->mapSize) {
+        return NULL;
+    }
+    return img->map + offset;
 }
 
-int diskimg_getsize(int dfd) {
-    return lseek(dfd, 0, SEEK_END);
+/* Copies count bytes starting at offset out of the mapping, mirroring
+   pread(): a short count at the end of the image and 0 past it.
+ */
+static ssize_t diskimg_mapread(struct diskimg *img, off_t offset, void *buf,
+                               size_t count) {
+    if ((uint64_t) offset >= img->mapSize) {
+        return 0;
+    }
+    if (count > img->mapSize - offset) {
+        count = img->mapSize - offset;
+    }
+    memcpy(buf, img->map + offset, count);
+    return count;
 }
 
 int diskimg_readsector(int dfd, int sectorNum, void *buf) {
-    if (lseek(dfd, sectorNum * DISKIMG_SECTOR_SIZE, SEEK_SET) == (off_t) -1) {
+    return diskimg_readsectors(dfd, sectorNum, 1, buf);
+}
+
+int diskimg_readsectors(int dfd, int firstSector, int count, void *buf) {
+    // the byte count is returned as an int
+    if (firstSector < 0 || count < 0 || count > INT_MAX / DISKIMG_SECTOR_SIZE) {
         return -1;
     }
-    return read(dfd, buf, DISKIMG_SECTOR_SIZE);
+
+    uint64_t start = diskimg_now();
+    off_t offset = (off_t) firstSector * DISKIMG_SECTOR_SIZE;
+    size_t bytes = (size_t) count * DISKIMG_SECTOR_SIZE;
+    struct diskimg *img = diskimg_lookup(dfd);
+    ssize_t result = 0;
+    int syscalls = 0;
+    if (img != NULL && img->backend == DISKIMG_BACKEND_MMAP) {
+        result = diskimg_mapread(img, offset, buf, bytes);
+    } else {
+        bytes = diskimg_clamp(img, offset, bytes);
+        if (bytes > 0) {
+            result = pread(dfd, buf, bytes, offset + diskimg_getbaseoffset(dfd));
+            syscalls = 1;
+        }
+    }
+
+    diskimg_recordio(dfd, DISKIMG_OP_READ, result, syscalls, diskimg_now() - start);
+    return result;
+}
+
+int diskimg_readsectorsv(int dfd, const int sectorNums[],
+                         const struct iovec iov[], int count) {
+    // the total is returned as an int
+    size_t wanted = 0;
+    for (int i = 0; i < count; i++) {
+        if (iov[i].iov_len > (size_t) INT_MAX - wanted) {
+            return -1;
+        }
+        wanted += iov[i].iov_len;
+    }
+
+    struct diskimg *img = diskimg_lookup(dfd);
+    uint64_t startTime = diskimg_now();
+    int syscalls = 0;
+    int total = 0;
+    int i = 0;
+    while (i < count) {
+        if (sectorNums[i] < 0) {
+            total = -1;
+            break;
+        }
+
+        // Extend the run while each buffer picks up where the last one ended.
+        off_t start = (off_t) sectorNums[i] * DISKIMG_SECTOR_SIZE;
+        off_t end = start + iov[i].iov_len;
+        size_t runBytes = iov[i].iov_len;
+        int runLen = 1;
+        while (i + runLen < count && runLen < IOV_MAX &&
+               (off_t) sectorNums[i + runLen] * DISKIMG_SECTOR_SIZE == end) {
+            end += iov[i + runLen].iov_len;
+            runBytes += iov[i + runLen].iov_len;
+            runLen++;
+        }
+
+        ssize_t bytes = 0;
+        if (img != NULL && img->backend == DISKIMG_BACKEND_MMAP) {
+            off_t offset = start;
+            for (int j = i; j < i + runLen; j++) {
+                ssize_t n = diskimg_mapread(img, offset, iov[j].iov_base,
+                                            iov[j].iov_len);
+                bytes += n;
+                offset += n;
+                if ((size_t) n < iov[j].iov_len) {
+                    break;
+                }
+            }
+        } else {
+            // Trim the run so it stops at the end of the image's region.
+            struct iovec runIov[runLen];
+            memcpy(runIov, &iov[i], runLen * sizeof(struct iovec));
+            size_t allowed = diskimg_clamp(img, start, runBytes);
+            int n = 0;
+            for (size_t left = allowed; n < runLen && left > 0; n++) {
+                if (runIov[n].iov_len > left) {
+                    runIov[n].iov_len = left;
+                }
+                left -= runIov[n].iov_len;
+            }
+
+            if (n > 0) {
+                bytes = preadv(dfd, runIov, n, start + diskimg_getbaseoffset(dfd));
+                syscalls++;
+                if (bytes < 0) {
+                    total = -1;
+                    break;
+                }
+            }
+        }
+
+        total += bytes;
+        if ((size_t) bytes < runBytes) {
+            break;      // hit the end of the image
+        }
+        i += runLen;
+    }
+
+    diskimg_recordio(dfd, DISKIMG_OP_READV, total, syscalls,
+                     diskimg_now() - startTime);
+    return total;
+}
+
+/* Writes all count bytes at buf to outfd at outOffset.  Returns 0 on
+   success, or -1 on error.
+ */
+static int diskimg_writeall(int outfd, const uint8_t *buf, size_t count,
+                            off_t outOffset) {
+    while (count > 0) {
+        ssize_t n = pwrite(outfd, buf, count, outOffset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        count -= n;
+        outOffset += n;
+    }
+    return 0;
+}
+
+/* Copies count bytes at image offset offset to outfd through the page
+   cache, with copy_file_range where the kernel supports it and a bounce
+   buffer otherwise.  Returns the bytes copied, or -1 on error.
+ */
+static ssize_t diskimg_fdcopy(int dfd, off_t offset, size_t count, int outfd,
+                              off_t outOffset, int *syscalls) {
+    loff_t in = offset + diskimg_getbaseoffset(dfd);
+    loff_t out = outOffset;
+    size_t done = 0;
+#ifdef __NR_copy_file_range
+    while (done < count) {
+        ssize_t n = syscall(__NR_copy_file_range, dfd, &in, outfd, &out,
+                            count - done, 0);
+        (*syscalls)++;
+        if (n == 0) {
+            return done;        // end of the file
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (done == 0 && (errno == ENOSYS || errno == EXDEV ||
+                              errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;          // not supported here: fall back
+            }
+            return -1;
+        }
+        done += n;
+    }
+#endif
+
+    uint8_t *buf = NULL;
+    while (done < count) {
+        if (buf == NULL && (buf = malloc(DISKIMG_COPY_CHUNK)) == NULL) {
+            return -1;
+        }
+        size_t chunk = count - done;
+        if (chunk > DISKIMG_COPY_CHUNK) {
+            chunk = DISKIMG_COPY_CHUNK;
+        }
+        ssize_t n = pread(dfd, buf, chunk, in);
+        (*syscalls)++;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return n < 0 ? -1 : (ssize_t) done;
+        }
+        if (diskimg_writeall(outfd, buf, n, out) != 0) {
+            free(buf);
+            return -1;
+        }
+        (*syscalls)++;
+        in += n;
+        out += n;
+        done += n;
+    }
+    free(buf);
+    return done;
+}
+
+ssize_t diskimg_copyout(int dfd, int firstSector, size_t count, int outfd,
+                        off_t outOffset) {
+    if (firstSector < 0) {
+        return -1;
+    }
+
+    uint64_t start = diskimg_now();
+    off_t offset = (off_t) firstSector * DISKIMG_SECTOR_SIZE;
+    struct diskimg *img = diskimg_lookup(dfd);
+    ssize_t result = 0;
+    int syscalls = 0;
+    if (img != NULL && img->backend == DISKIMG_BACKEND_MMAP) {
+        // Write straight out of the mapping.
+        if ((uint64_t) offset < img->mapSize) {
+            if (count > img->mapSize - offset) {
+                count = img->mapSize - offset;
+            }
+            result = diskimg_writeall(outfd, img->map + offset, count, outOffset);
+            result = result == 0 ? (ssize_t) count : -1;
+            syscalls = 1;
+        }
+    } else {
+        count = diskimg_clamp(img, offset, count);
+        if (count > 0) {
+            result = diskimg_fdcopy(dfd, offset, count, outfd, outOffset, &syscalls);
+        }
+    }
+
+    diskimg_recordio(dfd, DISKIMG_OP_READ, result, syscalls, diskimg_now() - start);
+    return result;
 }
 
 int diskimg_writesector(int dfd, int sectorNum, const void *buf) {
-    if (lseek(dfd, sectorNum * DISKIMG_SECTOR_SIZE, SEEK_SET) == (off_t) -1) {
-      return -1;
+    // Writes always go through the descriptor; a shared mapping of the
+    // same file sees them without any extra work.
+    off_t offset = (off_t) sectorNum * DISKIMG_SECTOR_SIZE;
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (sectorNum < 0 ||
+        diskimg_clamp(img, offset, DISKIMG_SECTOR_SIZE) != DISKIMG_SECTOR_SIZE) {
+        return -1;
+    }
+
+    uint64_t start = diskimg_now();
+    int result = pwrite(dfd, buf, DISKIMG_SECTOR_SIZE,
+                        offset + diskimg_getbaseoffset(dfd));
+    diskimg_recordio(dfd, DISKIMG_OP_WRITE, result, 1, diskimg_now() - start);
+    return result;
+}
+
+void diskimg_recordio(int dfd, int op, int64_t bytes, int syscalls,
+                      uint64_t nanos) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img == NULL || op < 0 || op >= DISKIMG_NUM_OPS) {
+        return;
+    }
+
+    struct diskimg_stats *stats = &img->stats;
+    diskimg_count(&stats->ops[op], 1);
+    diskimg_count(&stats->syscalls, syscalls);
+    if (bytes > 0) {
+        uint64_t sectors = (bytes + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+        if (op == DISKIMG_OP_WRITE) {
+            diskimg_count(&stats->bytesWritten, bytes);
+            diskimg_count(&stats->sectorsWritten, sectors);
+        } else {
+            diskimg_count(&stats->bytesRead, bytes);
+            diskimg_count(&stats->sectorsRead, sectors);
+        }
+    }
+
+    // Bucket i holds latencies in [2^i, 2^(i+1)) nanoseconds.
+    int bucket = 63 - __builtin_clzll(nanos | 1);
+    if (bucket >= DISKIMG_LATENCY_BUCKETS) {
+        bucket = DISKIMG_LATENCY_BUCKETS - 1;
+    }
+    diskimg_count(&stats->latency[op][bucket], 1);
+}
+
+void diskimg_recordcache(int dfd, int hit) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img != NULL) {
+        diskimg_count(hit ? &img->stats.cacheHits : &img->stats.cacheMisses, 1);
+    }
+}
+
+int diskimg_getstats(int dfd, struct diskimg_stats *stats) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img == NULL) {
+        return -1;
+    }
+
+    // The struct is nothing but counters, so copy it one word at a time.
+    const uint64_t *src = (const uint64_t *) &img->stats;
+    uint64_t *dst = (uint64_t *) stats;
+    for (size_t i = 0; i < sizeof(struct diskimg_stats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void diskimg_resetstats(int dfd) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img == NULL) {
+        return;
+    }
+    uint64_t *counters = (uint64_t *) &img->stats;
+    for (size_t i = 0; i < sizeof(struct diskimg_stats) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
-    return write(dfd, buf, DISKIMG_SECTOR_SIZE);
 }
 
 int diskimg_close(int dfd) {
+    struct diskimg *img = diskimg_lookup(dfd);
+    if (img != NULL) {
+        if (img->mapStart != NULL) {
+            munmap(img->mapStart, img->mapLength);
+        }
+        free(img);
+        images[dfd] = NULL;
+    }
     return close(dfd);
 }
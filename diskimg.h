@@ -2,21 +2,102 @@
 #define _DISKIMG_H_
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 // Size of a disk sector (e.g. block) in bytes.
 #define DISKIMG_SECTOR_SIZE 512
 
+// Backends that can be chosen when opening a disk image.
+#define DISKIMG_BACKEND_FD   0   // pread/preadv on the file descriptor
+#define DISKIMG_BACKEND_MMAP 1   // the whole image is mapped into memory
+
+// Operations tracked by the I/O statistics.
+#define DISKIMG_OP_READ   0      // diskimg_readsector(s)
+#define DISKIMG_OP_READV  1      // diskimg_readsectorsv
+#define DISKIMG_OP_WRITE  2      // diskimg_writesector
+#define DISKIMG_OP_AIO    3      // diskimg_aio reads, submit to completion;
+                                 // unless io_uring serviced them, their
+                                 // bytes are counted under DISKIMG_OP_READ
+#define DISKIMG_NUM_OPS   4
+
+#define DISKIMG_LATENCY_BUCKETS 32
+
+/**
+ * I/O counters kept for each open disk image.  latency[op][i] counts
+ * operations that took between 2^i and 2^(i+1) nanoseconds; the last
+ * bucket also holds anything slower.  Every field is a uint64_t.
+ */
+struct diskimg_stats {
+    uint64_t sectorsRead;
+    uint64_t sectorsWritten;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t syscalls;
+    uint64_t cacheHits;          // reported by the sector cache
+    uint64_t cacheMisses;
+    uint64_t ops[DISKIMG_NUM_OPS];
+    uint64_t latency[DISKIMG_NUM_OPS][DISKIMG_LATENCY_BUCKETS];
+};
+
+/**
+ * Settings for diskimg_open_options.  baseOffset and length select the
+ * part of the file holding the filesystem, e.g. one partition of a larger
+ * container image; sector 0 is read from baseOffset.
+ */
+struct diskimg_options {
+    int readOnly;
+    int backend;                 // one of the DISKIMG_BACKEND_* values
+    off_t baseOffset;            // byte offset of sector 0 within the file
+    off_t length;                // bytes in the image, or 0 for the rest
+                                 // of the file
+};
+
 /**
  * Opens a disk image for I/O. Returns an open file descriptor, or -1 if
  * unsuccessful.  
  */
 int diskimg_open(const char *pathname, int readOnly);
 
+/**
+ * Like diskimg_open, but selects the backend used for sector reads (one of
+ * the DISKIMG_BACKEND_* values).  If the image can't be mapped, the
+ * descriptor backend is used instead.  Returns an open file descriptor, or
+ * -1 if unsuccessful.
+ */
+int diskimg_open_backend(const char *pathname, int readOnly, int backend);
+
+/**
+ * Opens the part of a file described by opts for I/O.  Reads past the end
+ * of that part come back short, as at the end of a file.  Returns an open
+ * file descriptor, or -1 if unsuccessful.
+ */
+int diskimg_open_options(const char *pathname,
+                         const struct diskimg_options *opts);
+
+/**
+ * Returns the backend actually in use for the given disk file descriptor.
+ */
+int diskimg_getbackend(int dfd);
+
 /**
  * Returns the size in bytes of the disk image specified by the given disk
  * file descriptor, or -1 if unsuccessful.
  */
-int diskimg_getsize(int dfd);
+off_t diskimg_getsize(int dfd);
+
+/**
+ * Returns the byte offset within the underlying file at which sector 0 of
+ * the disk image starts.
+ */
+off_t diskimg_getbaseoffset(int dfd);
+
+/**
+ * Returns how many of the count bytes starting at byte offset (from sector
+ * 0) lie within the region of the file opened as the image, for I/O paths
+ * outside this file that read the file directly.
+ */
+size_t diskimg_clampread(int dfd, off_t offset, size_t count);
 
 /**
  * Reads the specified sector (e.g. sectorNum) from the disk image specified
@@ -25,6 +106,44 @@ int diskimg_getsize(int dfd);
  */
 int diskimg_readsector(int dfd, int sectorNum, void *buf);
 
+/**
+ * Reads count consecutive sectors starting at firstSector into buf, which
+ * must hold count * DISKIMG_SECTOR_SIZE bytes.  Uses a single positional
+ * read, so it is safe to call from several threads on the same descriptor.
+ * Returns the number of bytes read (short at the end of the image), or -1
+ * on error or if count * DISKIMG_SECTOR_SIZE doesn't fit in an int.
+ */
+int diskimg_readsectors(int dfd, int firstSector, int count, void *buf);
+
+/**
+ * Scatter/gather read: fills iov[i] starting at sector sectorNums[i], for
+ * each of the count entries.  Each iov_len should be a multiple of the
+ * sector size.  Entries that continue where the previous one ended are
+ * merged into a single vectored read.  Returns the total number of bytes
+ * read (short at the end of the image), or -1 on error or if the total
+ * asked for doesn't fit in an int.
+ */
+int diskimg_readsectorsv(int dfd, const int sectorNums[],
+                         const struct iovec iov[], int count);
+
+/**
+ * Returns a read-only pointer to the specified sector without copying it,
+ * or NULL if the image isn't memory-mapped or the sector is out of range.
+ * The pointer stays valid until diskimg_close().
+ */
+const void *diskimg_getsectorptr(int dfd, int sectorNum);
+
+/**
+ * Copies count bytes of the image, starting at the beginning of
+ * firstSector, to the file outfd at byte offset outOffset.  The data moves
+ * between the files in the kernel with copy_file_range when it can, or is
+ * written straight out of the mapping for a mapped image, rather than
+ * through a user buffer.  Returns the number of bytes copied (short at the
+ * end of the image), or -1 on error.
+ */
+ssize_t diskimg_copyout(int dfd, int firstSector, size_t count, int outfd,
+                        off_t outOffset);
+
 /**
  * Writes the information at buf to the specified sector on the disk image
  * specified by the given disk file descriptor.
@@ -32,6 +151,30 @@ int diskimg_readsector(int dfd, int sectorNum, void *buf);
  */
 int diskimg_writesector(int dfd, int sectorNum, const void *buf);
 
+/**
+ * Copies the I/O counters for the given disk file descriptor into *stats.
+ * Returns 0 on success, or -1 if no counters are kept for it.
+ */
+int diskimg_getstats(int dfd, struct diskimg_stats *stats);
+
+/**
+ * Zeroes the I/O counters for the given disk file descriptor.
+ */
+void diskimg_resetstats(int dfd);
+
+/**
+ * Adds one operation of type op to the counters: bytes moved (if
+ * positive), syscalls issued and how long it took.  Used by I/O paths
+ * outside this file, such as the io_uring engine.
+ */
+void diskimg_recordio(int dfd, int op, int64_t bytes, int syscalls,
+                      uint64_t nanos);
+
+/**
+ * Counts one sector cache hit (hit != 0) or miss.
+ */
+void diskimg_recordcache(int dfd, int hit);
+
 /**
  * Clean up from a previous diskimg_open() call.  Returns 0 on success,
  * or -1 on error.
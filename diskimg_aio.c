@@ -0,0 +1,473 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "diskimg.h"
+#include "diskimg_aio.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#define AIO_MAX_DEPTH   4096
+#define AIO_MAX_THREADS 16
+
+/* One queued or in-flight read.  Requests not in use are chained through
+   next on the free list; finished ones are chained on the ready list.
+ */
+struct aio_request {
+    int firstSector;
+    int count;
+    struct iovec iov;
+    void *tag;
+    int result;
+    int next;
+    uint64_t submitted;     // monotonic nanoseconds, for the statistics
+};
+
+struct diskimg_aio {
+    int dfd;
+    int engine;
+    int depth;
+    int inflight;           // changed under lock, read atomically by
+                            // diskimg_aio_inflight without it
+    struct aio_request *reqs;
+    int freeHead;
+
+    // Requests waiting for a worker, and finished requests waiting to be
+    // reaped (-1 terminated lists through aio_request.next).
+    int pendingHead, pendingTail;
+    int readyHead, readyTail;
+
+    // Thread engine.
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t workDone;
+    pthread_t threads[AIO_MAX_THREADS];
+    int numThreads;
+    bool stopping;
+
+#ifdef HAVE_IO_URING
+    // io_uring engine.
+    int ringFd;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;
+    int unreportedSyscalls; // enters not yet added to the statistics
+#endif
+};
+
+static uint64_t aio_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void aio_push(struct diskimg_aio *aio, int *head, int *tail, int idx) {
+    aio->reqs[idx].next = -1;
+    if (*tail == -1) {
+        *head = idx;
+    } else {
+        aio->reqs[*tail].next = idx;
+    }
+    *tail = idx;
+}
+
+static int aio_pop(struct diskimg_aio *aio, int *head, int *tail) {
+    int idx = *head;
+    if (idx != -1) {
+        *head = aio->reqs[idx].next;
+        if (*head == -1) {
+            *tail = -1;
+        }
+    }
+    return idx;
+}
+
+/* Moves finished requests from the ready list into out and returns them to
+   the free list.  Caller holds the lock when the thread engine is running.
+ */
+static int aio_drain_ready(struct diskimg_aio *aio,
+                           struct diskimg_aio_completion *out, int max) {
+    int n = 0;
+    while (n < max && aio->readyHead != -1) {
+        int idx = aio_pop(aio, &aio->readyHead, &aio->readyTail);
+        out[n].tag = aio->reqs[idx].tag;
+        out[n].result = aio->reqs[idx].result;
+        aio->reqs[idx].next = aio->freeHead;
+        aio->freeHead = idx;
+        __atomic_fetch_sub(&aio->inflight, 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+/***** THREAD ENGINE *****/
+
+static void *aio_worker(void *arg) {
+    struct diskimg_aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->pendingHead == -1 && !aio->stopping) {
+            pthread_cond_wait(&aio->workAvailable, &aio->lock);
+        }
+        if (aio->pendingHead == -1) {
+            break;
+        }
+
+        int idx = aio_pop(aio, &aio->pendingHead, &aio->pendingTail);
+        struct aio_request *req = &aio->reqs[idx];
+        pthread_mutex_unlock(&aio->lock);
+
+        int result = diskimg_readsectors(aio->dfd, req->firstSector,
+                                         req->count, req->iov.iov_base);
+
+        // The read itself was counted by diskimg_readsectors.
+        diskimg_recordio(aio->dfd, DISKIMG_OP_AIO, 0, 0, aio_now() - req->submitted);
+
+        pthread_mutex_lock(&aio->lock);
+        req->result = result;
+        aio_push(aio, &aio->readyHead, &aio->readyTail, idx);
+        pthread_cond_broadcast(&aio->workDone);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int aio_threads_start(struct diskimg_aio *aio) {
+    int numThreads = aio->depth < AIO_MAX_THREADS ? aio->depth : AIO_MAX_THREADS;
+    for (int i = 0; i < numThreads; i++) {
+        if (pthread_create(&aio->threads[i], NULL, aio_worker, aio) != 0) {
+            break;
+        }
+        aio->numThreads++;
+    }
+    return aio->numThreads > 0 ? 0 : -1;
+}
+
+static void aio_threads_stop(struct diskimg_aio *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stopping = true;
+    pthread_cond_broadcast(&aio->workAvailable);
+    pthread_mutex_unlock(&aio->lock);
+    for (int i = 0; i < aio->numThreads; i++) {
+        pthread_join(aio->threads[i], NULL);
+    }
+}
+
+/***** IO_URING ENGINE *****/
+
+#ifdef HAVE_IO_URING
+
+static int aio_uring_start(struct diskimg_aio *aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    aio->ringFd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (aio->ringFd < 0) {
+        return -1;
+    }
+
+    aio->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cqRingSize = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cqRingSize > aio->sqRingSize) {
+            aio->sqRingSize = aio->cqRingSize;
+        }
+        aio->cqRingSize = 0;
+    }
+
+    aio->sqRing = mmap(NULL, aio->sqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, aio->ringFd, IORING_OFF_SQ_RING);
+    if (aio->sqRing == MAP_FAILED) {
+        close(aio->ringFd);
+        return -1;
+    }
+
+    aio->cqRing = aio->sqRing;
+    if (aio->cqRingSize != 0) {
+        aio->cqRing = mmap(NULL, aio->cqRingSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, aio->ringFd, IORING_OFF_CQ_RING);
+        if (aio->cqRing == MAP_FAILED) {
+            munmap(aio->sqRing, aio->sqRingSize);
+            close(aio->ringFd);
+            return -1;
+        }
+    }
+
+    aio->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, aio->ringFd, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED) {
+        if (aio->cqRingSize != 0) {
+            munmap(aio->cqRing, aio->cqRingSize);
+        }
+        munmap(aio->sqRing, aio->sqRingSize);
+        close(aio->ringFd);
+        return -1;
+    }
+
+    char *sq = aio->sqRing;
+    char *cq = aio->cqRing;
+    aio->sqHead = (unsigned *) (sq + params.sq_off.head);
+    aio->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    aio->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    aio->sqArray = (unsigned *) (sq + params.sq_off.array);
+    aio->cqHead = (unsigned *) (cq + params.cq_off.head);
+    aio->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    aio->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void aio_uring_stop(struct diskimg_aio *aio) {
+    munmap(aio->sqes, aio->sqesSize);
+    if (aio->cqRingSize != 0) {
+        munmap(aio->cqRing, aio->cqRingSize);
+    }
+    munmap(aio->sqRing, aio->sqRingSize);
+    close(aio->ringFd);
+}
+
+static void aio_uring_queue(struct diskimg_aio *aio, int idx) {
+    struct aio_request *req = &aio->reqs[idx];
+    unsigned tail = *aio->sqTail;
+    unsigned slot = tail & *aio->sqMask;
+    struct io_uring_sqe *sqe = &aio->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = aio->dfd;
+    sqe->off = (uint64_t) req->firstSector * DISKIMG_SECTOR_SIZE +
+               diskimg_getbaseoffset(aio->dfd);
+    sqe->addr = (uint64_t) (uintptr_t) &req->iov;
+    sqe->len = 1;
+    sqe->user_data = idx;
+    aio->sqArray[slot] = slot;
+    __atomic_store_n(aio->sqTail, tail + 1, __ATOMIC_RELEASE);
+    aio->toSubmit++;
+}
+
+/* Hands queued entries to the kernel, optionally waiting for minComplete
+   completions.  Returns 0 on success, or -1 on error.
+ */
+static int aio_uring_enter(struct diskimg_aio *aio, unsigned minComplete) {
+    while (aio->toSubmit > 0 || minComplete > 0) {
+        unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret = syscall(__NR_io_uring_enter, aio->ringFd, aio->toSubmit,
+                          minComplete, flags, NULL, 0);
+        aio->unreportedSyscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        aio->toSubmit -= ret;
+        if (aio->toSubmit == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Moves entries from the completion ring onto the ready list. */
+static void aio_uring_collect(struct diskimg_aio *aio) {
+    unsigned head = *aio->cqHead;
+    unsigned tail = __atomic_load_n(aio->cqTail, __ATOMIC_ACQUIRE);
+    uint64_t now = aio_now();
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cqMask];
+        int idx = cqe->user_data;
+        aio->reqs[idx].result = cqe->res < 0 ? -1 : cqe->res;
+        diskimg_recordio(aio->dfd, DISKIMG_OP_AIO, cqe->res,
+                         aio->unreportedSyscalls, now - aio->reqs[idx].submitted);
+        aio->unreportedSyscalls = 0;
+        aio_push(aio, &aio->readyHead, &aio->readyTail, idx);
+        head++;
+    }
+    __atomic_store_n(aio->cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif // HAVE_IO_URING
+
+/***** PUBLIC INTERFACE *****/
+
+struct diskimg_aio *diskimg_aio_create(int dfd, int depth, int engine) {
+    if (depth < 1) {
+        return NULL;
+    }
+    if (depth > AIO_MAX_DEPTH) {
+        depth = AIO_MAX_DEPTH;
+    }
+
+    struct diskimg_aio *aio = calloc(1, sizeof(struct diskimg_aio));
+    if (aio == NULL) {
+        return NULL;
+    }
+    aio->reqs = calloc(depth, sizeof(struct aio_request));
+    if (aio->reqs == NULL) {
+        free(aio);
+        return NULL;
+    }
+
+    aio->dfd = dfd;
+    aio->depth = depth;
+    for (int i = 0; i < depth; i++) {
+        aio->reqs[i].next = i + 1 < depth ? i + 1 : -1;
+    }
+    aio->freeHead = 0;
+    aio->pendingHead = aio->pendingTail = -1;
+    aio->readyHead = aio->readyTail = -1;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->workAvailable, NULL);
+    pthread_cond_init(&aio->workDone, NULL);
+
+    aio->engine = DISKIMG_AIO_THREADS;
+#ifdef HAVE_IO_URING
+    if (engine != DISKIMG_AIO_THREADS && aio_uring_start(aio) == 0) {
+        aio->engine = DISKIMG_AIO_URING;
+    }
+#endif
+    if (aio->engine == DISKIMG_AIO_THREADS && aio_threads_start(aio) != 0) {
+        diskimg_aio_destroy(aio);
+        return NULL;
+    }
+    return aio;
+}
+
+int diskimg_aio_engine(const struct diskimg_aio *aio) {
+    return aio->engine;
+}
+
+int diskimg_aio_submit(struct diskimg_aio *aio, int firstSector, int count,
+                       void *buf, void *tag) {
+    pthread_mutex_lock(&aio->lock);
+    int idx = aio->freeHead;
+    if (idx == -1 || firstSector < 0 || count < 1) {
+        pthread_mutex_unlock(&aio->lock);
+        return -1;
+    }
+    aio->freeHead = aio->reqs[idx].next;
+    __atomic_fetch_add(&aio->inflight, 1, __ATOMIC_RELAXED);
+
+    struct aio_request *req = &aio->reqs[idx];
+    req->firstSector = firstSector;
+    req->count = count;
+    req->iov.iov_base = buf;
+    // io_uring reads the file directly, so stop at the end of the region
+    // here the way the other paths do
+    req->iov.iov_len = diskimg_clampread(aio->dfd, (off_t) firstSector * DISKIMG_SECTOR_SIZE,
+                                         (size_t) count * DISKIMG_SECTOR_SIZE);
+    req->tag = tag;
+    req->submitted = aio_now();
+
+    if (diskimg_getbackend(aio->dfd) == DISKIMG_BACKEND_MMAP) {
+        // A mapped image never blocks on I/O, so finish the copy right away.
+        req->result = diskimg_readsectors(aio->dfd, firstSector, count, buf);
+        diskimg_recordio(aio->dfd, DISKIMG_OP_AIO, 0, 0, aio_now() - req->submitted);
+        aio_push(aio, &aio->readyHead, &aio->readyTail, idx);
+    } else if (aio->engine == DISKIMG_AIO_THREADS) {
+        aio_push(aio, &aio->pendingHead, &aio->pendingTail, idx);
+        pthread_cond_signal(&aio->workAvailable);
+    } else {
+#ifdef HAVE_IO_URING
+        aio_uring_queue(aio, idx);
+#endif
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+int diskimg_aio_flush(struct diskimg_aio *aio) {
+#ifdef HAVE_IO_URING
+    if (aio->engine == DISKIMG_AIO_URING) {
+        pthread_mutex_lock(&aio->lock);
+        int err = aio_uring_enter(aio, 0);
+        pthread_mutex_unlock(&aio->lock);
+        return err;
+    }
+#endif
+    return 0;
+}
+
+int diskimg_aio_inflight(const struct diskimg_aio *aio) {
+    return __atomic_load_n(&aio->inflight, __ATOMIC_RELAXED);
+}
+
+int diskimg_aio_reap(struct diskimg_aio *aio,
+                     struct diskimg_aio_completion *out, int max, int minWait) {
+    pthread_mutex_lock(&aio->lock);
+    if (minWait > aio->inflight) {
+        minWait = aio->inflight;
+    }
+    if (minWait > max) {
+        minWait = max;
+    }
+
+    int n = aio_drain_ready(aio, out, max);
+#ifdef HAVE_IO_URING
+    if (aio->engine == DISKIMG_AIO_URING) {
+        aio_uring_collect(aio);
+        n += aio_drain_ready(aio, out + n, max - n);
+        while (n < minWait) {
+            if (aio_uring_enter(aio, minWait - n) != 0) {
+                pthread_mutex_unlock(&aio->lock);
+                return n > 0 ? n : -1;
+            }
+            aio_uring_collect(aio);
+            n += aio_drain_ready(aio, out + n, max - n);
+        }
+        pthread_mutex_unlock(&aio->lock);
+        return n;
+    }
+#endif
+    while (n < minWait) {
+        pthread_cond_wait(&aio->workDone, &aio->lock);
+        n += aio_drain_ready(aio, out + n, max - n);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return n;
+}
+
+void diskimg_aio_destroy(struct diskimg_aio *aio) {
+    if (aio == NULL) {
+        return;
+    }
+
+    // Buffers belong to the caller, so nothing may still be writing to them.
+    struct diskimg_aio_completion done[64];
+    while (diskimg_aio_inflight(aio) > 0) {
+        if (diskimg_aio_reap(aio, done, 64, 1) < 0) {
+            break;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (aio->engine == DISKIMG_AIO_URING) {
+        aio_uring_stop(aio);
+    }
+#endif
+    if (aio->engine == DISKIMG_AIO_THREADS) {
+        aio_threads_stop(aio);
+    }
+    pthread_cond_destroy(&aio->workDone);
+    pthread_cond_destroy(&aio->workAvailable);
+    pthread_mutex_destroy(&aio->lock);
+    free(aio->reqs);
+    free(aio);
+}
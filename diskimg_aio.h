@@ -0,0 +1,72 @@
+/* This file defines an asynchronous interface for reading sectors from a
+ * disk image: callers queue many reads, then reap completions as they
+ * arrive.  It runs on io_uring where the kernel supports it, and on a small
+ * pool of threads issuing positional reads otherwise.
+ */
+
+#ifndef _DISKIMG_AIO_H_
+#define _DISKIMG_AIO_H_
+
+// Engines that can service a queue.
+#define DISKIMG_AIO_AUTO    -1   // io_uring if available, else threads
+#define DISKIMG_AIO_URING    0
+#define DISKIMG_AIO_THREADS  1
+
+struct diskimg_aio;
+
+/**
+ * One finished read, as returned by diskimg_aio_reap.  result is the number
+ * of bytes read (short at the end of the image), or -1 on error.
+ */
+struct diskimg_aio_completion {
+    void *tag;
+    int result;
+};
+
+/**
+ * Creates a queue on the given disk file descriptor that allows up to depth
+ * reads in flight at once.  engine is one of the DISKIMG_AIO_* values; if
+ * io_uring is requested but unavailable, the thread engine is used.
+ * Returns NULL on error.
+ */
+struct diskimg_aio *diskimg_aio_create(int dfd, int depth, int engine);
+
+/**
+ * Returns the engine actually servicing the queue.
+ */
+int diskimg_aio_engine(const struct diskimg_aio *aio);
+
+/**
+ * Queues a read of count sectors starting at firstSector into buf.  tag is
+ * handed back with the completion.  The read may not be started until the
+ * next diskimg_aio_flush or diskimg_aio_reap.  Returns 0 on success, or -1
+ * if the queue already has depth reads in flight.
+ */
+int diskimg_aio_submit(struct diskimg_aio *aio, int firstSector, int count,
+                       void *buf, void *tag);
+
+/**
+ * Starts every queued read without waiting for any to finish.
+ * Returns 0 on success, or -1 on error.
+ */
+int diskimg_aio_flush(struct diskimg_aio *aio);
+
+/**
+ * Returns the number of reads submitted but not yet reaped.
+ */
+int diskimg_aio_inflight(const struct diskimg_aio *aio);
+
+/**
+ * Collects up to max finished reads into out, first waiting until at least
+ * minWait of them (capped at the number in flight) have finished.
+ * Returns the number of completions stored, or -1 on error.
+ */
+int diskimg_aio_reap(struct diskimg_aio *aio,
+                     struct diskimg_aio_completion *out, int max, int minWait);
+
+/**
+ * Waits for any reads still in flight, then frees the queue.
+ */
+void diskimg_aio_destroy(struct diskimg_aio *aio);
+
+#endif // _DISKIMG_AIO_H_
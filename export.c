@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "export.h"
+#include "inode.h"
+#include "file.h"
+#include "diskimg.h"
+#include "direntv6.h"
+#include "directory.h"
+
+// Directory nesting export_tree follows before giving up.
+#define EXPORT_MAX_DEPTH 64
+
+// Hex digits per directory level in a sort key (see struct export_record).
+#define EXPORT_KEY_DIGITS 6
+
+/* This function copies the part of a file within blocks [firstBlock,
+   endBlock) to outfd, one diskimg_copyout per extent it overlaps.
+   Returns 0 on success, or -1 on error.
+ */
+static int export_copyrange(const struct unixfilesystem *fs,
+                            const struct inode_extent *extents, int numExtents,
+                            int size, int firstBlock, int endBlock, int outfd) {
+    for (int i = 0; i < numExtents; i++) {
+        int lo = extents[i].fileBlock;
+        int hi = lo + extents[i].numBlocks;
+        if (lo < firstBlock) {
+            lo = firstBlock;
+        }
+        if (hi > endBlock) {
+            hi = endBlock;
+        }
+        if (lo >= hi || extents[i].sector == INODE_HOLE) {
+            continue;   // holes are left for ftruncate to zero-fill
+        }
+
+        // the last extent stops at the end of the file, not of its block
+        off_t start = (off_t) lo * DISKIMG_SECTOR_SIZE;
+        size_t bytes = (size_t) (hi - lo) * DISKIMG_SECTOR_SIZE;
+        if (bytes > (size_t) (size - start)) {
+            bytes = size - start;
+        }
+        int sector = extents[i].sector + (lo - extents[i].fileBlock);
+        if (diskimg_copyout(fs->dfd, sector, bytes, outfd, start) != (ssize_t) bytes) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* This function creates the host file for an export, keeping the owner's
+   access so the file can be exported over again.  Returns the descriptor,
+   or -1 on error.
+ */
+static int export_create(const char *hostPath, const struct inode *in) {
+    int outfd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, (in->i_mode & 0777) | 0600);
+    if (outfd < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", hostPath, strerror(errno));
+    }
+    return outfd;
+}
+
+/* This function sets the final size of a host file and closes it.
+   Returns 0 on success, or -1 on error.
+ */
+static int export_finish(const char *hostPath, int outfd, int size) {
+    int result = 0;
+    if (ftruncate(outfd, size) != 0) {
+        fprintf(stderr, "Can't set the size of %s: %s\n", hostPath, strerror(errno));
+        result = -1;
+    }
+    if (close(outfd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int export_file(const struct unixfilesystem *fs, int inumber, const char *hostPath) {
+    struct inode in;
+    if (inode_iget(fs, inumber, &in) != 0) {
+        fprintf(stderr, "Error: Inode read improperly.\n");
+        return -1;
+    }
+
+    struct inode_extent *extents;
+    int numExtents = inode_extents(fs, &in, &extents);
+    if (numExtents < 0) {
+        return -1;
+    }
+
+    int outfd = export_create(hostPath, &in);
+    if (outfd < 0) {
+        free(extents);
+        return -1;
+    }
+
+    int size = inode_getsize(&in);
+    int numBlocks = (size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    int result = export_copyrange(fs, extents, numExtents, size, 0, numBlocks, outfd);
+    free(extents);
+    if (result != 0) {
+        fprintf(stderr, "Error copying inode %d to %s\n", inumber, hostPath);
+        close(outfd);
+        return -1;
+    }
+    return export_finish(hostPath, outfd, size);
+}
+
+/* The parallel tree export.
+ *
+ * Work is broken into tasks: one per directory, one per file, and for
+ * large files, one per range of splitBlocks blocks.  Each worker owns a
+ * deque of tasks.  It pushes the tasks it discovers onto the bottom and
+ * takes its next task from the bottom too, so it walks the tree depth
+ * first.  A worker whose deque is empty steals from the top of another's,
+ * which hands it the oldest (and so usually biggest) piece of work there.
+ *
+ * Every file gets a record, keyed by the positions of the directory
+ * entries on its path.  Sorting the records by key puts them back in the
+ * order a sequential depth-first walk visits the files, whatever order the
+ * workers finished them in.
+ */
+
+#define TASK_DIR   0
+#define TASK_FILE  1
+#define TASK_RANGE 2
+
+struct export_bigfile;
+
+struct export_task {
+    int kind;
+    int inumber;                // TASK_DIR, TASK_FILE
+    int depth;                  // TASK_DIR
+    char *hostPath;             // TASK_DIR, TASK_FILE
+    char *key;                  // TASK_DIR, TASK_FILE
+    struct export_bigfile *big; // TASK_RANGE
+    int firstBlock;             // TASK_RANGE
+    int endBlock;
+};
+
+/* A file being copied by several TASK_RANGEs at once; the last one to
+   finish closes it.
+ */
+struct export_bigfile {
+    int outfd;
+    int size;
+    int record;                 // index into job->records
+    struct inode_extent *extents;
+    int numExtents;
+    int pending;                // ranges still running (atomic)
+    int failed;                 // set by any range that fails (atomic)
+};
+
+struct export_record {
+    char *key;                  // EXPORT_KEY_DIGITS hex digits per level
+    char *hostPath;
+    int inumber;
+    int size;
+    int result;
+};
+
+struct export_deque {
+    pthread_mutex_t lock;
+    struct export_task **tasks; // ring buffer of cap entries
+    int cap;
+    int top;                    // next to steal
+    int count;
+};
+
+struct export_job {
+    const struct unixfilesystem *fs;
+    const struct export_options *opts;
+    int numWorkers;
+    struct export_deque *deques;
+
+    int outstanding;            // tasks pushed but not finished (atomic)
+    int queued;                 // tasks sitting in deques (atomic)
+    pthread_mutex_t idleLock;   // idle workers wait on idleCond
+    pthread_cond_t idleCond;
+
+    pthread_mutex_t recordLock;
+    struct export_record *records;
+    int numRecords;
+    int recordCap;
+    int failed;                 // a directory couldn't be exported (atomic)
+};
+
+struct export_worker {
+    struct export_job *job;
+    int id;
+};
+
+static int deque_push(struct export_deque *dq, struct export_task *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        int cap = dq->cap > 0 ? dq->cap * 2 : 64;
+        struct export_task **tasks = malloc(cap * sizeof(struct export_task *));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (int i = 0; i < dq->count; i++) {
+            tasks[i] = dq->tasks[(dq->top + i) % dq->cap];
+        }
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->cap = cap;
+        dq->top = 0;
+    }
+    dq->tasks[(dq->top + dq->count) % dq->cap] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* Takes the newest task (the owner's end) or, if steal is set, the oldest
+   one (a thief's end).  Returns NULL if the deque is empty.
+ */
+static struct export_task *deque_take(struct export_deque *dq, bool steal) {
+    struct export_task *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        if (steal) {
+            task = dq->tasks[dq->top];
+            dq->top = (dq->top + 1) % dq->cap;
+        } else {
+            task = dq->tasks[(dq->top + dq->count - 1) % dq->cap];
+        }
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static void task_free(struct export_task *task) {
+    free(task->hostPath);
+    free(task->key);
+    free(task);
+}
+
+/* Queues a task on worker id's deque and wakes an idle worker to steal
+   it.  Takes ownership of the task.  Returns 0 on success, or -1 if out
+   of memory.
+ */
+static int job_push(struct export_job *job, int id, struct export_task *task) {
+    __atomic_add_fetch(&job->outstanding, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&job->deques[id], task) != 0) {
+        __atomic_sub_fetch(&job->outstanding, 1, __ATOMIC_SEQ_CST);
+        task_free(task);
+        return -1;
+    }
+    __atomic_add_fetch(&job->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&job->idleLock);
+    pthread_cond_signal(&job->idleCond);
+    pthread_mutex_unlock(&job->idleLock);
+    return 0;
+}
+
+/* Returns the next task for worker id, waiting while other workers may
+   still produce some.  Returns NULL once every task has finished.
+ */
+static struct export_task *job_next(struct export_job *job, int id) {
+    while (true) {
+        struct export_task *task = deque_take(&job->deques[id], false);
+        for (int i = 1; task == NULL && i < job->numWorkers; i++) {
+            task = deque_take(&job->deques[(id + i) % job->numWorkers], true);
+        }
+        if (task != NULL) {
+            __atomic_sub_fetch(&job->queued, 1, __ATOMIC_SEQ_CST);
+            return task;
+        }
+
+        pthread_mutex_lock(&job->idleLock);
+        if (__atomic_load_n(&job->outstanding, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&job->idleLock);
+            return NULL;
+        }
+        if (__atomic_load_n(&job->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&job->idleCond, &job->idleLock);
+        }
+        pthread_mutex_unlock(&job->idleLock);
+    }
+}
+
+/* Marks a task finished, waking everyone if it was the last one. */
+static void job_done(struct export_job *job) {
+    if (__atomic_sub_fetch(&job->outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&job->idleLock);
+        pthread_cond_broadcast(&job->idleCond);
+        pthread_mutex_unlock(&job->idleLock);
+    }
+}
+
+/* Adds a record for a file, taking ownership of key and hostPath.
+   Returns its index, or -1 if out of memory.
+ */
+static int job_record(struct export_job *job, char *key, char *hostPath,
+                      int inumber, int size) {
+    pthread_mutex_lock(&job->recordLock);
+    if (job->numRecords == job->recordCap) {
+        int cap = job->recordCap > 0 ? job->recordCap * 2 : 256;
+        struct export_record *records = realloc(job->records,
+                                                cap * sizeof(struct export_record));
+        if (records == NULL) {
+            pthread_mutex_unlock(&job->recordLock);
+            free(key);
+            free(hostPath);
+            return -1;
+        }
+        job->records = records;
+        job->recordCap = cap;
+    }
+    int index = job->numRecords++;
+    struct export_record *rec = &job->records[index];
+    rec->key = key;
+    rec->hostPath = hostPath;
+    rec->inumber = inumber;
+    rec->size = size;
+    rec->result = -1;
+    pthread_mutex_unlock(&job->recordLock);
+    return index;
+}
+
+static void job_setresult(struct export_job *job, int record, int result) {
+    pthread_mutex_lock(&job->recordLock);
+    job->records[record].result = result;
+    pthread_mutex_unlock(&job->recordLock);
+}
+
+static struct export_task *task_new(int kind) {
+    struct export_task *task = calloc(1, sizeof(struct export_task));
+    if (task == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    task->kind = kind;
+    return task;
+}
+
+/* This function creates a directory on the host and queues a task for
+   each subdirectory and regular file in it.
+ */
+static int run_dir(struct export_job *job, int id, struct export_task *task) {
+    const struct unixfilesystem *fs = job->fs;
+    if (task->depth > EXPORT_MAX_DEPTH) {
+        fprintf(stderr, "Directories nested too deeply at %s\n", task->hostPath);
+        return -1;
+    }
+    if (mkdir(task->hostPath, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create %s: %s\n", task->hostPath, strerror(errno));
+        return -1;
+    }
+
+    struct directory *dir = directory_open(fs, task->inumber);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int result;
+    int entryIndex = -1;
+    const struct direntv6 *dirEnt;
+    while ((result = directory_next(dir, &dirEnt)) == 1) {
+        entryIndex++;
+
+        // Skip names that can't be host file names: empty, . and .., or
+        // holding a '/'.  The copy is also what the host path is built from.
+        char name[MAX_COMPONENT_LENGTH + 1];
+        strncpy(name, dirEnt->d_name, MAX_COMPONENT_LENGTH);
+        name[MAX_COMPONENT_LENGTH] = '\0';
+        if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            strchr(name, '/') != NULL) {
+            continue;
+        }
+
+        struct inode in;
+        if (inode_iget(fs, dirEnt->d_inumber, &in) != 0) {
+            fprintf(stderr, "Error: Inode read improperly.\n");
+            result = -1;
+            break;
+        }
+        int kind;
+        if ((in.i_mode & IALLOC) == 0) {
+            continue;
+        } else if ((in.i_mode & IFMT) == IFDIR) {
+            kind = TASK_DIR;
+        } else if ((in.i_mode & IFMT) == 0) {
+            kind = TASK_FILE;
+        } else {
+            continue;       // device files
+        }
+
+        struct export_task *child = task_new(kind);
+        if (child == NULL) {
+            result = -1;
+            break;
+        }
+        child->inumber = dirEnt->d_inumber;
+        child->depth = task->depth + 1;
+        size_t pathLen = strlen(task->hostPath) + 1 + strlen(name) + 1;
+        size_t keyLen = strlen(task->key) + EXPORT_KEY_DIGITS + 1;
+        child->hostPath = malloc(pathLen);
+        child->key = malloc(keyLen);
+        if (child->hostPath == NULL || child->key == NULL || pathLen > PATH_MAX) {
+            fprintf(stderr, "Can't export %s under %s\n", name, task->hostPath);
+            task_free(child);
+            result = -1;
+            break;
+        }
+        snprintf(child->hostPath, pathLen, "%s/%s", task->hostPath, name);
+        snprintf(child->key, keyLen, "%s%0*x", task->key, EXPORT_KEY_DIGITS, entryIndex);
+        if (job_push(job, id, child) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    directory_close(dir);
+    return result;
+}
+
+/* This function exports one file: directly if it is small, or by queuing
+   a TASK_RANGE for each splitBlocks blocks of it.
+ */
+static void run_file(struct export_job *job, int id, struct export_task *task) {
+    const struct unixfilesystem *fs = job->fs;
+    struct inode in;
+    int size = -1;
+    if (inode_iget(fs, task->inumber, &in) == 0) {
+        size = inode_getsize(&in);
+    }
+
+    // the record owns the path and key from here on
+    char *hostPath = task->hostPath;
+    int record = job_record(job, task->key, hostPath, task->inumber, size);
+    task->key = NULL;
+    task->hostPath = NULL;
+    if (record < 0 || size < 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct inode_extent *extents;
+    int numExtents = inode_extents(fs, &in, &extents);
+    if (numExtents < 0) {
+        return;
+    }
+    int outfd = export_create(hostPath, &in);
+    if (outfd < 0) {
+        free(extents);
+        return;
+    }
+
+    int numBlocks = (size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    int split = job->opts->splitBlocks;
+    if (job->numWorkers == 1 || split <= 0 || numBlocks <= split) {
+        int result = export_copyrange(fs, extents, numExtents, size, 0, numBlocks, outfd);
+        free(extents);
+        if (result != 0) {
+            fprintf(stderr, "Error copying inode %d to %s\n", task->inumber, hostPath);
+            close(outfd);
+        } else {
+            job_setresult(job, record, export_finish(hostPath, outfd, size));
+        }
+        return;
+    }
+
+    struct export_bigfile *big = calloc(1, sizeof(struct export_bigfile));
+    if (big == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        free(extents);
+        close(outfd);
+        return;
+    }
+    big->outfd = outfd;
+    big->size = size;
+    big->record = record;
+    big->extents = extents;
+    big->numExtents = numExtents;
+
+    // the ranges hold one count each, and this function holds one more
+    // until they are all queued
+    big->pending = 1;
+    for (int first = 0; first < numBlocks; first += split) {
+        struct export_task *range = task_new(TASK_RANGE);
+        if (range == NULL) {
+            big->failed = 1;
+            break;
+        }
+        range->big = big;
+        range->firstBlock = first;
+        range->endBlock = first + split < numBlocks ? first + split : numBlocks;
+        __atomic_add_fetch(&big->pending, 1, __ATOMIC_SEQ_CST);
+        if (job_push(job, id, range) != 0) {
+            __atomic_sub_fetch(&big->pending, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&big->failed, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+    task->big = big;
+}
+
+/* Drops one reference to a large file, finishing it if it was the last. */
+static void bigfile_release(struct export_job *job, struct export_bigfile *big) {
+    if (__atomic_sub_fetch(&big->pending, 1, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&job->recordLock);
+    const char *hostPath = job->records[big->record].hostPath;
+    pthread_mutex_unlock(&job->recordLock);
+    int result;
+    if (__atomic_load_n(&big->failed, __ATOMIC_SEQ_CST)) {
+        close(big->outfd);
+        result = -1;
+    } else {
+        result = export_finish(hostPath, big->outfd, big->size);
+    }
+    job_setresult(job, big->record, result);
+    free(big->extents);
+    free(big);
+}
+
+static void run_range(struct export_job *job, struct export_task *task) {
+    struct export_bigfile *big = task->big;
+    if (export_copyrange(job->fs, big->extents, big->numExtents, big->size,
+                         task->firstBlock, task->endBlock, big->outfd) != 0) {
+        fprintf(stderr, "Error copying blocks %d-%d\n", task->firstBlock, task->endBlock - 1);
+        __atomic_store_n(&big->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    bigfile_release(job, big);
+}
+
+static void *export_worker(void *arg) {
+    struct export_worker *worker = arg;
+    struct export_job *job = worker->job;
+    struct export_task *task;
+    while ((task = job_next(job, worker->id)) != NULL) {
+        if (task->kind == TASK_DIR) {
+            if (run_dir(job, worker->id, task) != 0) {
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            }
+        } else if (task->kind == TASK_FILE) {
+            run_file(job, worker->id, task);
+            if (task->big != NULL) {
+                bigfile_release(job, task->big);
+            }
+        } else {
+            run_range(job, task);
+        }
+        task_free(task);
+        job_done(job);
+    }
+    return NULL;
+}
+
+static int record_compare(const void *a, const void *b) {
+    return strcmp(((const struct export_record *) a)->key,
+                  ((const struct export_record *) b)->key);
+}
+
+void export_default_options(struct export_options *opts) {
+    opts->threads = 1;
+    opts->splitBlocks = EXPORT_DEFAULT_SPLIT_BLOCKS;
+    opts->report = NULL;
+    opts->arg = NULL;
+}
+
+int export_tree(const struct unixfilesystem *fs, int dirinumber, const char *hostDir) {
+    struct export_options opts;
+    export_default_options(&opts);
+    return export_tree_options(fs, dirinumber, hostDir, &opts);
+}
+
+int export_tree_options(const struct unixfilesystem *fs, int dirinumber,
+                        const char *hostDir, const struct export_options *opts) {
+    struct export_job job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.opts = opts;
+    job.numWorkers = opts->threads > 0 ? opts->threads : 1;
+    job.deques = calloc(job.numWorkers, sizeof(struct export_deque));
+    struct export_worker *workers = calloc(job.numWorkers, sizeof(struct export_worker));
+    pthread_t *threads = calloc(job.numWorkers, sizeof(pthread_t));
+    struct export_task *root = task_new(TASK_DIR);
+    if (job.deques == NULL || workers == NULL || threads == NULL || root == NULL ||
+        (root->hostPath = strdup(hostDir)) == NULL || (root->key = strdup("")) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        if (root != NULL) {
+            task_free(root);
+        }
+        free(job.deques);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+    for (int i = 0; i < job.numWorkers; i++) {
+        pthread_mutex_init(&job.deques[i].lock, NULL);
+        workers[i].job = &job;
+        workers[i].id = i;
+    }
+    pthread_mutex_init(&job.idleLock, NULL);
+    pthread_cond_init(&job.idleCond, NULL);
+    pthread_mutex_init(&job.recordLock, NULL);
+
+    root->inumber = dirinumber;
+    int started = 1;
+    if (job_push(&job, 0, root) != 0) {
+        job.failed = 1;
+    } else {
+        // worker 0 runs on this thread
+        for (; started < job.numWorkers; started++) {
+            if (pthread_create(&threads[started], NULL, export_worker, &workers[started]) != 0) {
+                break;
+            }
+        }
+        export_worker(&workers[0]);
+        for (int i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    // report in sequential walk order
+    qsort(job.records, job.numRecords, sizeof(struct export_record), record_compare);
+    int exported = 0;
+    for (int i = 0; i < job.numRecords; i++) {
+        struct export_record *rec = &job.records[i];
+        if (opts->report != NULL) {
+            opts->report(rec->hostPath, rec->inumber, rec->size, rec->result, opts->arg);
+        }
+        if (rec->result == 0) {
+            exported++;
+        } else {
+            job.failed = 1;
+        }
+        free(rec->key);
+        free(rec->hostPath);
+    }
+
+    for (int i = 0; i < job.numWorkers; i++) {
+        pthread_mutex_destroy(&job.deques[i].lock);
+        free(job.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&job.idleLock);
+    pthread_cond_destroy(&job.idleCond);
+    pthread_mutex_destroy(&job.recordLock);
+    free(job.records);
+    free(job.deques);
+    free(workers);
+    free(threads);
+    return job.failed ? -1 : exported;
+}
@@ -0,0 +1,59 @@
+/* This file defines functions that copy files and directory trees out of
+ * the filesystem into the host's filesystem.  File data is copied a whole
+ * extent at a time with diskimg_copyout, so it moves between the files in
+ * the kernel instead of a sector at a time through user buffers.
+ */
+
+#ifndef _EXPORT_H_
+#define _EXPORT_H_
+
+#include "unixfilesystem.h"
+
+// Files bigger than this many blocks (1 MiB) are split into ranges of this
+// many blocks, copied in parallel, by export_tree_options.
+#define EXPORT_DEFAULT_SPLIT_BLOCKS 2048
+
+/**
+ * Settings for export_tree_options.
+ */
+struct export_options {
+    int threads;                 // Worker threads, including the caller's.
+    int splitBlocks;             // Blocks per range when splitting large
+                                 // files; 0 never splits them.
+    void (*report)(const char *hostPath, int inumber, int size, int result,
+                   void *arg);   // If not NULL, called for every file once
+                                 // the export is done, in the order of a
+                                 // depth-first walk; result is 0 or -1.
+    void *arg;                   // Passed to report.
+};
+
+/**
+ * Writes the contents of the file with the given inumber to hostPath,
+ * creating or truncating it.  The host file ends up exactly as long as
+ * the inode's size.  Returns 0 on success, or -1 on error.
+ */
+int export_file(const struct unixfilesystem *fs, int inumber, const char *hostPath);
+
+/**
+ * Recreates the directory with the given inumber, and everything below
+ * it, under hostDir (created if needed).  Regular files are exported with
+ * export_file; device files and deleted entries are skipped.  Returns the
+ * number of files exported, or -1 on error.
+ */
+int export_tree(const struct unixfilesystem *fs, int dirinumber, const char *hostDir);
+
+/**
+ * Fills in *opts with the settings export_tree uses: one thread.
+ */
+void export_default_options(struct export_options *opts);
+
+/**
+ * Like export_tree, but spreads directories, files and ranges of large
+ * files across opts->threads threads that steal work from each other.
+ * The host tree, the return value and the calls to opts->report are the
+ * same for any number of threads.
+ */
+int export_tree_options(const struct unixfilesystem *fs, int dirinumber,
+                        const char *hostDir, const struct export_options *opts);
+
+#endif // _EXPORT_H_
@@ -1,36 +1,313 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "file.h"
 #include "inode.h"
 #include "diskimg.h"
+#include "readahead.h"
+
+#define NUM_SGL_INDIR_BLOCKS 7
+
+static const int BLOCKNUMS_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(uint16_t);
+
+// What every hole reads as; handed out by file_handle_getblock_ref.
+static const char zeroBlock[DISKIMG_SECTOR_SIZE];
+
+struct file {
+    const struct unixfilesystem *fs;
+    int inumber;
+    struct inode inode;
+    int size;
+    int numBlocks;
+    int singlySector;       // sector held in singly, or -1
+    int doublySector;       // sector held in doubly, or -1
+    uint16_t singly[DISKIMG_SECTOR_SIZE / sizeof(uint16_t)];
+    uint16_t doubly[DISKIMG_SECTOR_SIZE / sizeof(uint16_t)];
+};
+
+/* Fills in a handle for the file with the given inumber.  Returns 0 on
+   success, or -1 if the inode can't be read.
+ */
+static int file_init(struct file *fp, const struct unixfilesystem *fs, int inumber) {
+    if (inode_iget(fs, inumber, &fp->inode) != 0) {
+        fprintf(stderr, "Error: Inode read improperly.\n");
+        return -1;
+    }
+    fp->fs = fs;
+    fp->inumber = inumber;
+    fp->size = inode_getsize(&fp->inode);
+    fp->numBlocks = (fp->size + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    fp->singlySector = -1;
+    fp->doublySector = -1;
+    return 0;
+}
+
+/* Reads sector into the given slot of a handle unless it already holds it.
+   Returns 0 on success, or -1 on error.
+ */
+static int file_loadindirect(struct file *fp, int sector, int *held, uint16_t *buf) {
+    if (*held == sector) {
+        return 0;
+    }
+    if (unixfilesystem_readsector(fp->fs, sector, buf) == -1) {
+        fprintf(stderr, "Error reading in sector. No bytes read\n");
+        *held = -1;
+        return -1;
+    }
+    *held = sector;
+    return 0;
+}
+
+/* Returns the sector holding block fileBlockIndex of an open file, with the
+   same results as inode_indexlookup, or -1 on error.
+ */
+static int file_lookup(struct file *fp, int fileBlockIndex) {
+    if ((fp->inode.i_mode & ILARG) == 0 ||
+        fileBlockIndex < 0 || fileBlockIndex >= fp->numBlocks) {
+        return inode_indexlookup(fp->fs, &fp->inode, fileBlockIndex);
+    }
+    if (fp->fs->blockMapCache != NULL) {
+        return inode_indexlookup_byinumber(fp->fs, fp->inumber, &fp->inode, fileBlockIndex);
+    }
+
+    int blockNum = fileBlockIndex / BLOCKNUMS_PER_BLOCK;
+    int indirectBlock;
+    if (blockNum < NUM_SGL_INDIR_BLOCKS) {
+        indirectBlock = fp->inode.i_addr[blockNum];
+    } else {
+        if (fp->inode.i_addr[NUM_SGL_INDIR_BLOCKS] == INODE_HOLE) {
+            return INODE_HOLE;
+        }
+        if (file_loadindirect(fp, fp->inode.i_addr[NUM_SGL_INDIR_BLOCKS],
+                              &fp->doublySector, fp->doubly) != 0) {
+            return -1;
+        }
+        indirectBlock = fp->doubly[blockNum - NUM_SGL_INDIR_BLOCKS];
+    }
+    if (indirectBlock == INODE_HOLE) {
+        return INODE_HOLE;
+    }
+    if (file_loadindirect(fp, indirectBlock, &fp->singlySector, fp->singly) != 0) {
+        return -1;
+    }
+    return fp->singly[fileBlockIndex % BLOCKNUMS_PER_BLOCK];
+}
+
+/* Tells the readahead state about a read of fileBlockIndex and, if the
+   file is being read sequentially, pulls the next window of its blocks
+   into the sector cache.
+ */
+static void file_readahead(struct file *fp, int fileBlockIndex) {
+    const struct unixfilesystem *fs = fp->fs;
+    int start;
+    int count = readahead_advise(fs->readahead, fp->inumber, fileBlockIndex,
+                                 fp->numBlocks, &start);
+    if (count <= 0) {
+        return;
+    }
+
+    int sectors[count];
+    for (int i = 0; i < count; i++) {
+        sectors[i] = file_lookup(fp, start + i);
+    }
+    readahead_fill(fs->readahead, fs->sectorCache, sectors, count);
+}
 
 /* This function reads a block of data from a file, given the file's
    i-number and the desired block within the file.
  */
 int file_getblock(const struct unixfilesystem *fs, int inumber,
         int fileBlockIndex, void *buf) {
-    struct inode inp;
-    if (inode_iget(fs, inumber, &inp) != 0) {
-        fprintf(stderr, "Error: Inode read improperly.\n");
+    struct file f;
+    if (file_init(&f, fs, inumber) != 0) {
+        return -1;
+    }
+    return file_handle_getblock(&f, fileBlockIndex, buf);
+}
+
+struct file *file_open(const struct unixfilesystem *fs, int inumber) {
+    struct file *fp = malloc(sizeof(struct file));
+    if (fp == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    if (file_init(fp, fs, inumber) != 0) {
+        free(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+const struct inode *file_getinode(const struct file *fp) {
+    return &fp->inode;
+}
+
+int file_getsize(const struct file *fp) {
+    return fp->size;
+}
+
+/* Returns the number of valid bytes in block fileBlockIndex of an open
+   file, given the number of bytes read for it.
+ */
+static int file_validbytes(const struct file *fp, int fileBlockIndex, int bytes) {
+    // check if block is in last index of file
+    if ((fp->size / DISKIMG_SECTOR_SIZE) == fileBlockIndex) {
+        return fp->size % DISKIMG_SECTOR_SIZE;
+    }
+    return bytes;
+}
+
+/* This function reads a block of data from an open file.
+ */
+int file_handle_getblock(struct file *fp, int fileBlockIndex, void *buf) {
+    int blockNum = file_lookup(fp, fileBlockIndex);
+    if (blockNum == -1) {
+        fprintf(stderr, "Error: Invalid index.\n");
         return -1;
     }
 
-    int blockNum = inode_indexlookup(fs, &inp, fileBlockIndex);
+    int bytes = DISKIMG_SECTOR_SIZE;
+    if (blockNum == INODE_HOLE) {
+        memset(buf, 0, DISKIMG_SECTOR_SIZE);
+    } else {
+        bytes = unixfilesystem_readsector(fp->fs, blockNum, buf);
+        if (bytes == -1) {
+            fprintf(stderr, "Error: Data read in improperly.\n");
+            return -1;
+        }
+    }
+
+    if (fp->fs->readahead != NULL) {
+        file_readahead(fp, fileBlockIndex);
+    }
+    return file_validbytes(fp, fileBlockIndex, bytes);
+}
+
+int file_getblock_ref(const struct unixfilesystem *fs, int inumber,
+        int fileBlockIndex, const void **data) {
+    struct file f;
+    if (file_init(&f, fs, inumber) != 0) {
+        return -1;
+    }
+    return file_handle_getblock_ref(&f, fileBlockIndex, data);
+}
+
+/* This function returns a reference to a block of an open file rather
+   than a copy of it.
+ */
+int file_handle_getblock_ref(struct file *fp, int fileBlockIndex, const void **data) {
+    int blockNum = file_lookup(fp, fileBlockIndex);
     if (blockNum == -1) {
         fprintf(stderr, "Error: Invalid index.\n");
         return -1;
     }
 
-    int fileSize = inode_getsize(&inp);
-    int bytes = diskimg_readsector(fs->dfd, blockNum, buf);
-    if (bytes == -1) {
+    *data = blockNum == INODE_HOLE ? zeroBlock : unixfilesystem_getsector(fp->fs, blockNum);
+    if (*data == NULL) {
         fprintf(stderr, "Error: Data read in improperly.\n");
         return -1;
     }
 
-    // check if block is in last index of file
-    if ((fileSize / DISKIMG_SECTOR_SIZE) == fileBlockIndex) {
-        return fileSize % DISKIMG_SECTOR_SIZE;
+    if (fp->fs->readahead != NULL) {
+        file_readahead(fp, fileBlockIndex);
     }
-    return bytes;
-}
\ No newline at end of file
+    return file_validbytes(fp, fileBlockIndex, DISKIMG_SECTOR_SIZE);
+}
+
+void file_releaseblock_ref(const struct unixfilesystem *fs, const void *data) {
+    if (data != zeroBlock) {
+        unixfilesystem_releasesector(fs, data);
+    }
+}
+
+int file_pread(const struct unixfilesystem *fs, int inumber, int offset,
+        int len, void *buf) {
+    struct file f;
+    if (file_init(&f, fs, inumber) != 0) {
+        return -1;
+    }
+    return file_handle_pread(&f, offset, len, buf);
+}
+
+/* This function reads a byte range of an open file.  Partial blocks at
+   either end go through the sector cache; runs of whole blocks that are
+   consecutive on disk are read directly into the caller's buffer.
+ */
+int file_handle_pread(struct file *fp, int offset, int len, void *buf) {
+    if (offset < 0 || len < 0) {
+        fprintf(stderr, "Error: Invalid file range.\n");
+        return -1;
+    }
+    if (offset >= fp->size) {
+        return 0;
+    }
+    if (len > fp->size - offset) {
+        len = fp->size - offset;
+    }
+
+    char *dst = buf;
+    int done = 0;
+    while (done < len) {
+        int pos = offset + done;
+        int fileBlockIndex = pos / DISKIMG_SECTOR_SIZE;
+        int within = pos % DISKIMG_SECTOR_SIZE;
+        int remaining = len - done;
+
+        int sector = file_lookup(fp, fileBlockIndex);
+        if (sector == -1) {
+            fprintf(stderr, "Error: Invalid index.\n");
+            return -1;
+        }
+
+        // partial block: bounce it through the cache
+        if (within != 0 || remaining < DISKIMG_SECTOR_SIZE) {
+            char block[DISKIMG_SECTOR_SIZE];
+            if (sector == INODE_HOLE) {
+                memset(block, 0, DISKIMG_SECTOR_SIZE);
+            } else if (unixfilesystem_readsector(fp->fs, sector, block) == -1) {
+                fprintf(stderr, "Error: Data read in improperly.\n");
+                return -1;
+            }
+            int n = DISKIMG_SECTOR_SIZE - within;
+            if (n > remaining) {
+                n = remaining;
+            }
+            memcpy(dst + done, block + within, n);
+            done += n;
+            continue;
+        }
+
+        // whole blocks: extend the run while the next block follows on
+        // disk, or is another hole
+        int maxBlocks = remaining / DISKIMG_SECTOR_SIZE;
+        int count = 1;
+        while (count < maxBlocks) {
+            int next = file_lookup(fp, fileBlockIndex + count);
+            if (next == -1) {
+                fprintf(stderr, "Error: Invalid index.\n");
+                return -1;
+            }
+            if (sector == INODE_HOLE ? next != INODE_HOLE : next != sector + count) {
+                break;
+            }
+            count++;
+        }
+        if (sector == INODE_HOLE) {
+            memset(dst + done, 0, count * DISKIMG_SECTOR_SIZE);
+            done += count * DISKIMG_SECTOR_SIZE;
+            continue;
+        }
+        int bytes = diskimg_readsectors(fp->fs->dfd, sector, count, dst + done);
+        if (bytes != count * DISKIMG_SECTOR_SIZE) {
+            fprintf(stderr, "Error: Data read in improperly.\n");
+            return -1;
+        }
+        done += bytes;
+    }
+    return done;
+}
+
+void file_close(struct file *fp) {
+    free(fp);
+}
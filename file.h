@@ -1,5 +1,6 @@
-/* This file defines the file-layer function for fetching the data
- * for a specified part of a file.
+/* This file defines the file-layer functions for fetching the data
+ * for a specified part of a file, either by inumber or through an open
+ * file handle.
  */
 
 #ifndef _FILE_H_
@@ -16,9 +17,75 @@
  * Returns the number of valid bytes in the returned block;
  * this will be the same as the sector size, except for the last
  * block of a file.  Returns -1 if an error occurs in this function
- * or any function it calls.
+ * or any function it calls.  A hole (see INODE_HOLE) reads as a block of
+ * zeros without touching the disk.
  */
 int file_getblock(const struct unixfilesystem *fs, int inumber,
                   int fileBlockIndex, void *buf);
 
+struct file;
+
+/**
+ * Opens the file with the given inumber, reading its inode once.  The
+ * handle also keeps the indirect blocks it last used, so reading a file
+ * block by block through it reads each inode and indirect block once.
+ * Returns NULL if the inode can't be read or out of memory.
+ */
+struct file *file_open(const struct unixfilesystem *fs, int inumber);
+
+/**
+ * Returns the inode of an open file.
+ */
+const struct inode *file_getinode(const struct file *fp);
+
+/**
+ * Returns the size in bytes of an open file.
+ */
+int file_getsize(const struct file *fp);
+
+/**
+ * Same as file_getblock, for an open file.
+ */
+int file_handle_getblock(struct file *fp, int fileBlockIndex, void *buf);
+
+/**
+ * Like file_getblock, but instead of copying the block into a buffer,
+ * stores at *data a read-only pointer to it, into the mapped image or to
+ * the sector pinned in the cache.  Returns the number of valid bytes at
+ * *data, or -1 on error.  Each successful call must be paired with
+ * file_releaseblock_ref once the caller is done with the data.
+ */
+int file_getblock_ref(const struct unixfilesystem *fs, int inumber,
+                      int fileBlockIndex, const void **data);
+
+/**
+ * Same as file_getblock_ref, for an open file.
+ */
+int file_handle_getblock_ref(struct file *fp, int fileBlockIndex, const void **data);
+
+/**
+ * Releases a block returned by file_getblock_ref or file_handle_getblock_ref.
+ */
+void file_releaseblock_ref(const struct unixfilesystem *fs, const void *data);
+
+/**
+ * Reads up to len bytes of the file with the given inumber, starting at
+ * byte offset, into buf.  The range is clamped to the file's size and may
+ * start and end anywhere within a block.  Whole blocks that are adjacent
+ * on disk are read with a single request straight into buf.  Returns the
+ * number of bytes read (0 at or past the end of the file), or -1 on error.
+ */
+int file_pread(const struct unixfilesystem *fs, int inumber, int offset,
+               int len, void *buf);
+
+/**
+ * Same as file_pread, for an open file.
+ */
+int file_handle_pread(struct file *fp, int offset, int len, void *buf);
+
+/**
+ * Closes a file handle.
+ */
+void file_close(struct file *fp);
+
 #endif // _FILE_H_
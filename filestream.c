@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "filestream.h"
+#include "file.h"
+#include "diskimg.h"
+
+struct filestream {
+    const struct unixfilesystem *fs;
+    int *inumbers;
+    struct file *handle;                // the caller's open file, or NULL
+    int count;
+    int bufferBytes;
+    int numBuffers;
+    char *data;                         // numBuffers * bufferBytes
+    struct filestream_chunk *chunks;    // one per buffer; len -1 on error
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;              // signalled when numFilled rises
+    pthread_cond_t emptied;             // signalled when a buffer frees up
+    int next;                           // buffer the consumer reads next
+    int numFilled;                      // buffers waiting for the consumer
+    bool consumerHolds;                 // the consumer has buffer next - 1
+    bool finished;                      // the reader has nothing more to add
+    bool stopping;                      // filestream_close was called
+};
+
+/* Waits for a free buffer and returns its index, or -1 if the stream is
+   being closed.
+ */
+static int filestream_getbuffer(struct filestream *st) {
+    pthread_mutex_lock(&st->lock);
+    while (!st->stopping &&
+           st->numFilled + (st->consumerHolds ? 1 : 0) == st->numBuffers) {
+        pthread_cond_wait(&st->emptied, &st->lock);
+    }
+    // filled buffers run from next; the consumer's, if any, is just before
+    int index = -1;
+    if (!st->stopping) {
+        index = (st->next + st->numFilled) % st->numBuffers;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return index;
+}
+
+/* Hands a filled buffer to the consumer. */
+static void filestream_putbuffer(struct filestream *st) {
+    pthread_mutex_lock(&st->lock);
+    st->numFilled++;
+    pthread_cond_signal(&st->filled);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Reads [offset, offset + len) of a file a block at a time into buf,
+   keeping just the bytes file_handle_getblock says are valid in each, as
+   a block-by-block reader would.  Used when file_handle_pread can't read
+   the whole range.  Returns the bytes stored, or -1 with the offset of
+   the failing block at *badOffset.
+ */
+static int filestream_byblock(struct file *fp, int offset, int len, char *buf,
+                              int *badOffset) {
+    int stored = 0;
+    for (int pos = offset; pos < offset + len; pos += DISKIMG_SECTOR_SIZE) {
+        char block[DISKIMG_SECTOR_SIZE];
+        int bytes = file_handle_getblock(fp, pos / DISKIMG_SECTOR_SIZE, block);
+        if (bytes < 0) {
+            *badOffset = pos;
+            return -1;
+        }
+        memcpy(buf + stored, block, bytes);
+        stored += bytes;
+    }
+    return stored;
+}
+
+/* Closes a file the reader opened; the caller's handle stays open. */
+static void filestream_closefile(struct filestream *st, struct file *fp) {
+    if (fp != st->handle) {
+        file_close(fp);
+    }
+}
+
+/* The background reader: fills buffers with each file in turn. */
+static void *filestream_reader(void *arg) {
+    struct filestream *st = arg;
+    for (int f = 0; f < st->count; f++) {
+        int inumber = st->inumbers[f];
+        struct file *fp = st->handle != NULL ? st->handle : file_open(st->fs, inumber);
+        int size = fp != NULL ? file_getsize(fp) : 0;
+        int offset = 0;
+        do {
+            int index = filestream_getbuffer(st);
+            if (index < 0) {
+                filestream_closefile(st, fp);
+                return NULL;
+            }
+            struct filestream_chunk *chunk = &st->chunks[index];
+            char *buf = st->data + (size_t) index * st->bufferBytes;
+            int want = size - offset < st->bufferBytes ? size - offset : st->bufferBytes;
+
+            chunk->inumber = inumber;
+            chunk->offset = offset;
+            chunk->data = buf;
+            chunk->len = -1;
+            if (fp != NULL) {
+                chunk->len = file_handle_pread(fp, offset, want, buf);
+                if (chunk->len != want) {
+                    chunk->len = filestream_byblock(fp, offset, want, buf, &chunk->offset);
+                }
+            }
+            if (chunk->len < 0) {
+                filestream_closefile(st, fp);
+                filestream_putbuffer(st);
+                goto done;  // a failed file ends the stream
+            }
+            offset += want;
+            chunk->last = offset >= size;
+            filestream_putbuffer(st);
+        } while (offset < size);
+        filestream_closefile(st, fp);
+    }
+
+done:
+    pthread_mutex_lock(&st->lock);
+    st->finished = true;
+    pthread_cond_signal(&st->filled);
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/* Starts a stream over the count files in inumbers, read through handle
+   if it isn't NULL (count is then 1).
+ */
+static struct filestream *filestream_start(const struct unixfilesystem *fs,
+                                           const int inumbers[], int count,
+                                           struct file *handle,
+                                           int bufferBytes, int numBuffers) {
+    if (bufferBytes <= 0) {
+        bufferBytes = FILESTREAM_DEFAULT_BUFFER_BYTES;
+    }
+    bufferBytes = (bufferBytes + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE * DISKIMG_SECTOR_SIZE;
+    if (numBuffers <= 0) {
+        numBuffers = FILESTREAM_DEFAULT_BUFFERS;
+    }
+
+    struct filestream *st = calloc(1, sizeof(struct filestream));
+    if (st == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    st->fs = fs;
+    st->handle = handle;
+    st->count = count;
+    st->bufferBytes = bufferBytes;
+    st->numBuffers = numBuffers;
+    st->inumbers = malloc((count > 0 ? count : 1) * sizeof(int));
+    st->data = malloc((size_t) numBuffers * bufferBytes);
+    st->chunks = calloc(numBuffers, sizeof(struct filestream_chunk));
+    if (st->inumbers == NULL || st->data == NULL || st->chunks == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        free(st->inumbers);
+        free(st->data);
+        free(st->chunks);
+        free(st);
+        return NULL;
+    }
+    memcpy(st->inumbers, inumbers, count * sizeof(int));
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->filled, NULL);
+    pthread_cond_init(&st->emptied, NULL);
+
+    if (pthread_create(&st->thread, NULL, filestream_reader, st) != 0) {
+        fprintf(stderr, "Can't start the stream reader\n");
+        pthread_mutex_destroy(&st->lock);
+        pthread_cond_destroy(&st->filled);
+        pthread_cond_destroy(&st->emptied);
+        free(st->inumbers);
+        free(st->data);
+        free(st->chunks);
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+struct filestream *filestream_open(const struct unixfilesystem *fs,
+                                   const int inumbers[], int count,
+                                   int bufferBytes, int numBuffers) {
+    return filestream_start(fs, inumbers, count, NULL, bufferBytes, numBuffers);
+}
+
+struct filestream *filestream_open_file(const struct unixfilesystem *fs,
+                                        int inumber, struct file *fp,
+                                        int bufferBytes, int numBuffers) {
+    return filestream_start(fs, &inumber, 1, fp, bufferBytes, numBuffers);
+}
+
+int filestream_next(struct filestream *st, struct filestream_chunk *chunk) {
+    pthread_mutex_lock(&st->lock);
+    if (st->consumerHolds) {
+        // hand back the buffer from the last call
+        st->consumerHolds = false;
+        pthread_cond_signal(&st->emptied);
+    }
+    while (st->numFilled == 0 && !st->finished) {
+        pthread_cond_wait(&st->filled, &st->lock);
+    }
+    if (st->numFilled == 0) {
+        pthread_mutex_unlock(&st->lock);
+        return 0;
+    }
+
+    *chunk = st->chunks[st->next];
+    st->next = (st->next + 1) % st->numBuffers;
+    st->numFilled--;
+    st->consumerHolds = true;
+    pthread_mutex_unlock(&st->lock);
+    return chunk->len < 0 ? -1 : 1;
+}
+
+void filestream_close(struct filestream *st) {
+    if (st == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&st->lock);
+    st->stopping = true;
+    pthread_cond_signal(&st->emptied);
+    pthread_mutex_unlock(&st->lock);
+    pthread_join(st->thread, NULL);
+
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->filled);
+    pthread_cond_destroy(&st->emptied);
+    free(st->inumbers);
+    free(st->data);
+    free(st->chunks);
+    free(st);
+}
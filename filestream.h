@@ -0,0 +1,69 @@
+/* This file defines a streaming reader over the contents of one or more
+ * files.  A background thread reads each file in large chunks, with
+ * file_handle_pread, into a small ring of buffers, while the caller works
+ * on the chunk it was last handed.  Memory use is bounded by the buffers,
+ * and the disk and the consumer are both kept busy.
+ */
+
+#ifndef _FILESTREAM_H_
+#define _FILESTREAM_H_
+
+#include <stdbool.h>
+
+#include "unixfilesystem.h"
+#include "file.h"
+
+// Defaults used when filestream_open is given 0 for a setting.
+#define FILESTREAM_DEFAULT_BUFFER_BYTES (64 * 1024)
+#define FILESTREAM_DEFAULT_BUFFERS      2
+
+struct filestream;
+
+/**
+ * One piece of a file handed out by filestream_next.  Every file yields at
+ * least one chunk, so an empty file gives a single chunk with len 0.
+ */
+struct filestream_chunk {
+    int inumber;                // file the data belongs to
+    int offset;                 // byte offset of data within the file
+    int len;                    // bytes at data; short of the next chunk's
+                                // offset only if blocks read short, as
+                                // file_getblock would return them
+    bool last;                  // this is the file's final chunk
+    const void *data;
+};
+
+/**
+ * Starts streaming the count files listed in inumbers, in order, through
+ * numBuffers buffers of bufferBytes bytes each (0 picks the defaults above;
+ * bufferBytes is rounded up to whole sectors).  Returns NULL on error.
+ */
+struct filestream *filestream_open(const struct unixfilesystem *fs,
+                                   const int inumbers[], int count,
+                                   int bufferBytes, int numBuffers);
+
+/**
+ * Like filestream_open, but streams the single file inumber through fp,
+ * a handle the caller already has open on it, instead of opening the file
+ * again.  The caller must leave fp alone until filestream_close, and then
+ * closes it.
+ */
+struct filestream *filestream_open_file(const struct unixfilesystem *fs,
+                                        int inumber, struct file *fp,
+                                        int bufferBytes, int numBuffers);
+
+/**
+ * Waits for the next chunk and fills in *chunk.  chunk->data stays valid
+ * until the next call to filestream_next or filestream_close.  Returns 1
+ * if a chunk was returned, 0 once every file has been streamed, or -1 if
+ * a file couldn't be read; chunk->inumber and chunk->offset then give the
+ * file and the byte offset of the first block that failed.
+ */
+int filestream_next(struct filestream *st, struct filestream_chunk *chunk);
+
+/**
+ * Stops the background reader, if it's still running, and frees the stream.
+ */
+void filestream_close(struct filestream *st);
+
+#endif // _FILESTREAM_H_
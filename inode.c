@@ -2,8 +2,16 @@
 
 #include "inode.h"
 #include "diskimg.h"
+#include "inodetable.h"
+#include "lru.h"
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define INODE_BLOCK 2
 #define NUM_SGL_INDIR_BLOCKS 7
@@ -13,6 +21,18 @@ static const int SINGLY_INDIRECT_BYTES = 7 * (DISKIMG_SECTOR_SIZE / sizeof(uint1
                                          * DISKIMG_SECTOR_SIZE;
 static const int BLOCKNUMS_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(uint16_t);
 
+// Inode blocks read at once by inode_foreach_allocated.
+#define FOREACH_BATCH_BLOCKS 32
+
+/* The flattened block map of a large file, as kept in fs->blockMapCache.
+   inode is the copy it was built from, so a changed inode is noticed.
+ */
+struct inode_blockmap {
+    struct inode inode;
+    int numBlocks;
+    uint16_t blocks[];
+};
+
 /* This function reads the data for the inode with the specified
    inumber from the filesystem and fills in an inode struct with 
    that information. This function will return 0 opon success,
@@ -20,9 +40,26 @@ static const int BLOCKNUMS_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(uint16_t);
  */
 int inode_iget(const struct unixfilesystem *fs, int inumber,
         struct inode *inp) {
+    // served from the in-memory inode table when there is one
+    if (fs->inodeTable != NULL) {
+        if (inumber < 1 ||
+            inumber > inodetable_numblocks(fs->inodeTable) * INODES_PER_BLOCK) {
+            fprintf(stderr, "Invalid inumber %d\n", inumber);
+            return -1;
+        }
+        const struct inode *block = inodetable_block(fs->inodeTable,
+                                                     (inumber - 1) / INODES_PER_BLOCK);
+        if (block == NULL) {
+            fprintf(stderr, "Error reading in sector. No bytes read\n");
+            return -1;
+        }
+        *inp = block[(inumber - 1) % INODES_PER_BLOCK];
+        return 0;
+    }
+
     int sectorNum = INODE_BLOCK + (inumber - 1) / INODES_PER_BLOCK;
     struct inode buf[INODES_PER_BLOCK];
-    int bytes = diskimg_readsector(fs->dfd, sectorNum, buf);
+    int bytes = unixfilesystem_readsector(fs, sectorNum, buf);
     
     if (bytes == -1) {
         fprintf(stderr, "Error reading in sector. No bytes read\n");
@@ -59,8 +96,11 @@ int inode_indexlookup(const struct unixfilesystem *fs, struct inode *inp,
     }
 
     uint16_t indirectBlock = inp->i_addr[iaddrIndex];
+    if (indirectBlock == INODE_HOLE) {
+        return INODE_HOLE;      // the whole indirect block is a hole
+    }
     uint16_t buf[BLOCKNUMS_PER_BLOCK];
-    int bytes = diskimg_readsector(fs->dfd, indirectBlock, buf);
+    int bytes = unixfilesystem_readsector(fs, indirectBlock, buf);
 
     if (bytes == -1) {
         fprintf(stderr, "Error reading in sector. No bytes read\n");
@@ -74,7 +114,10 @@ int inode_indexlookup(const struct unixfilesystem *fs, struct inode *inp,
     // doubly indirect block
     } else {
         int secondIndex = blockNum - NUM_SGL_INDIR_BLOCKS;  // reset indexes at 0
-        bytes = diskimg_readsector(fs->dfd, buf[secondIndex], buf);
+        if (buf[secondIndex] == INODE_HOLE) {
+            return INODE_HOLE;
+        }
+        bytes = unixfilesystem_readsector(fs, buf[secondIndex], buf);
 
         if (bytes == -1) {
             fprintf(stderr, "Error reading in sector. No bytes read\n");
@@ -85,6 +128,351 @@ int inode_indexlookup(const struct unixfilesystem *fs, struct inode *inp,
     }
 }
 
+/* This function reads every indirect block of a large file once and
+   returns its block numbers as one array, or NULL on error.
+ */
+static struct inode_blockmap *inode_buildmap(const struct unixfilesystem *fs,
+        struct inode *inp) {
+    int numBlocks = (inode_getsize(inp) + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    struct inode_blockmap *map = malloc(sizeof(struct inode_blockmap) +
+                                        numBlocks * sizeof(uint16_t));
+    if (map == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+    map->inode = *inp;
+    map->numBlocks = numBlocks;
+
+    uint16_t doubly[BLOCKNUMS_PER_BLOCK];
+    bool haveDoubly = false;
+    for (int i = 0; i < numBlocks; i += BLOCKNUMS_PER_BLOCK) {
+        int blockNum = i / BLOCKNUMS_PER_BLOCK;
+        uint16_t indirectBlock;
+        if (blockNum < NUM_SGL_INDIR_BLOCKS) {
+            indirectBlock = inp->i_addr[blockNum];
+        } else {
+            if (!haveDoubly && inp->i_addr[NUM_SGL_INDIR_BLOCKS] == INODE_HOLE) {
+                memset(doubly, 0, sizeof(doubly));
+                haveDoubly = true;
+            } else if (!haveDoubly) {
+                if (unixfilesystem_readsector(fs, inp->i_addr[NUM_SGL_INDIR_BLOCKS],
+                                              doubly) == -1) {
+                    fprintf(stderr, "Error reading in sector. No bytes read\n");
+                    free(map);
+                    return NULL;
+                }
+                haveDoubly = true;
+            }
+            indirectBlock = doubly[blockNum - NUM_SGL_INDIR_BLOCKS];
+        }
+
+        int count = numBlocks - i;
+        if (count > BLOCKNUMS_PER_BLOCK) {
+            count = BLOCKNUMS_PER_BLOCK;
+        }
+        if (indirectBlock == INODE_HOLE) {
+            memset(&map->blocks[i], 0, count * sizeof(uint16_t));
+            continue;
+        }
+
+        uint16_t buf[BLOCKNUMS_PER_BLOCK];
+        if (unixfilesystem_readsector(fs, indirectBlock, buf) == -1) {
+            fprintf(stderr, "Error reading in sector. No bytes read\n");
+            free(map);
+            return NULL;
+        }
+        memcpy(&map->blocks[i], buf, count * sizeof(uint16_t));
+    }
+    return map;
+}
+
+/* This function returns the block number of the file data block at the
+   specified index, using the cached block map of the file when it can.
+ */
+int inode_indexlookup_byinumber(const struct unixfilesystem *fs, int inumber,
+        struct inode *inp, int fileBlockIndex) {
+    // small files already have every block number in the inode
+    int numBlocks = (inode_getsize(inp) + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    if (fs->blockMapCache == NULL || (inp->i_mode & ILARG) == 0 ||
+        fileBlockIndex < 0 || fileBlockIndex >= numBlocks) {
+        return inode_indexlookup(fs, inp, fileBlockIndex);
+    }
+
+    struct inode_blockmap **slot = lru_lookup(fs->blockMapCache, &inumber, sizeof(inumber));
+    if (slot != NULL &&
+        memcmp(&(*slot)->inode, inp, offsetof(struct inode, i_atime)) != 0) {
+        // stale: the inode changed since the map was built
+        lru_release(fs->blockMapCache, slot);
+        slot = NULL;
+    }
+
+    if (slot == NULL) {
+        struct inode_blockmap *map = inode_buildmap(fs, inp);
+        if (map == NULL) {
+            return -1;
+        }
+        slot = lru_insert(fs->blockMapCache, &inumber, sizeof(inumber), &map, numBlocks);
+        if (slot == NULL) {
+            int blockNum = map->blocks[fileBlockIndex];
+            free(map);
+            return blockNum;
+        }
+    }
+
+    int blockNum = (*slot)->blocks[fileBlockIndex];
+    lru_release(fs->blockMapCache, slot);
+    return blockNum;
+}
+
+/* This function merges runs of consecutive block numbers in the file's
+   block map into extents, stored in a malloc'd array at *extents.
+ */
+int inode_extents(const struct unixfilesystem *fs, struct inode *inp,
+        struct inode_extent **extents) {
+    *extents = NULL;
+    int numBlocks = (inode_getsize(inp) + DISKIMG_SECTOR_SIZE - 1) / DISKIMG_SECTOR_SIZE;
+    if (numBlocks == 0) {
+        return 0;
+    }
+
+    const uint16_t *blocks;
+    struct inode_blockmap *map = NULL;
+    if ((inp->i_mode & ILARG) == 0) {
+        int maxBlocks = sizeof(inp->i_addr) / sizeof(inp->i_addr[0]);
+        if (numBlocks > maxBlocks) {
+            numBlocks = maxBlocks;
+        }
+        blocks = inp->i_addr;
+    } else {
+        map = inode_buildmap(fs, inp);
+        if (map == NULL) {
+            return -1;
+        }
+        blocks = map->blocks;
+    }
+
+    // at most one extent per block; shrunk to fit below
+    struct inode_extent *out = malloc(numBlocks * sizeof(struct inode_extent));
+    if (out == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        free(map);
+        return -1;
+    }
+    int count = 0;
+    for (int i = 0; i < numBlocks; i++) {
+        bool hole = blocks[i] == INODE_HOLE;
+        if (count > 0 && (hole ? out[count - 1].sector == INODE_HOLE :
+                          out[count - 1].sector != INODE_HOLE &&
+                          out[count - 1].sector + out[count - 1].numBlocks == blocks[i])) {
+            out[count - 1].numBlocks++;
+        } else {
+            out[count].fileBlock = i;
+            out[count].sector = blocks[i];
+            out[count].numBlocks = 1;
+            count++;
+        }
+    }
+    free(map);
+
+    struct inode_extent *shrunk = realloc(out, count * sizeof(struct inode_extent));
+    *extents = shrunk != NULL ? shrunk : out;
+    return count;
+}
+
+/* This function returns a mask with bit i set if inode i of the given
+   inode block is allocated.
+ */
+static unsigned int inode_allocmask(const struct inode block[]) {
+#ifdef __SSE2__
+    // IALLOC is the sign bit of i_mode, the first word of each inode.
+    // Gather the 16 modes into two vectors and pack them into bytes with
+    // signed saturation, which keeps the sign bits for movemask to collect.
+    __m128i modes[2];
+    for (int half = 0; half < 2; half++) {
+        __m128i v[8];
+        for (int i = 0; i < 8; i++) {
+            v[i] = _mm_loadu_si128((const __m128i *) &block[half * 8 + i]);
+        }
+        __m128i m01 = _mm_unpacklo_epi16(v[0], v[1]);
+        __m128i m23 = _mm_unpacklo_epi16(v[2], v[3]);
+        __m128i m45 = _mm_unpacklo_epi16(v[4], v[5]);
+        __m128i m67 = _mm_unpacklo_epi16(v[6], v[7]);
+        modes[half] = _mm_unpacklo_epi64(_mm_unpacklo_epi32(m01, m23),
+                                         _mm_unpacklo_epi32(m45, m67));
+    }
+    return _mm_movemask_epi8(_mm_packs_epi16(modes[0], modes[1]));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        if (block[i].i_mode & IALLOC) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/* This function walks the inode table a batch of blocks at a time and
+   calls fn on each allocated inode, skipping free blocks entirely.
+ */
+int inode_foreach_allocated(const struct unixfilesystem *fs,
+        int (*fn)(int inumber, const struct inode *inp, void *arg), void *arg) {
+    int numBlocks = fs->superblock.s_isize;
+    struct inode buf[FOREACH_BATCH_BLOCKS * INODES_PER_BLOCK];
+
+    for (int first = 0; first < numBlocks; first += FOREACH_BATCH_BLOCKS) {
+        int count = numBlocks - first;
+        if (count > FOREACH_BATCH_BLOCKS) {
+            count = FOREACH_BATCH_BLOCKS;
+        }
+        if (fs->inodeTable == NULL) {
+            int bytes = diskimg_readsectors(fs->dfd, INODE_BLOCK + first, count, buf);
+            if (bytes != count * DISKIMG_SECTOR_SIZE) {
+                fprintf(stderr, "Error reading in sector. No bytes read\n");
+                return -1;
+            }
+        }
+
+        for (int b = 0; b < count; b++) {
+            const struct inode *block = &buf[b * INODES_PER_BLOCK];
+            if (fs->inodeTable != NULL) {
+                block = inodetable_block(fs->inodeTable, first + b);
+                if (block == NULL) {
+                    fprintf(stderr, "Error reading in sector. No bytes read\n");
+                    return -1;
+                }
+            }
+
+            unsigned int mask = inode_allocmask(block);
+            while (mask != 0) {
+                int i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                int inumber = (first + b) * INODES_PER_BLOCK + i + 1;
+                int result = fn(inumber, &block[i], arg);
+                if (result != 0) {
+                    return result;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* An inumber wanted by inode_iget_many and where its inode goes. */
+struct inode_request {
+    int inumber;
+    int index;
+};
+
+static int inode_comparerequests(const void *a, const void *b) {
+    int x = ((const struct inode_request *) a)->inumber;
+    int y = ((const struct inode_request *) b)->inumber;
+    return (x > y) - (x < y);
+}
+
+/* This function fetches many inodes, visiting the inode blocks in table
+   order and reading each one once for all the inodes wanted from it.
+   Without a cache, the blocks are read FOREACH_BATCH_BLOCKS at a time with
+   diskimg_readsectorsv, which merges adjacent ones into single reads.
+ */
+int inode_iget_many(const struct unixfilesystem *fs, const int inumbers[], int n,
+        struct inode inodes[]) {
+    int result = 0;
+    if (fs->inodeTable != NULL) {
+        // already in memory, in any order
+        for (int i = 0; i < n; i++) {
+            if (inode_iget(fs, inumbers[i], &inodes[i]) != 0) {
+                memset(&inodes[i], 0, sizeof(struct inode));
+                result = -1;
+            }
+        }
+        return result;
+    }
+
+    struct inode_request *requests = malloc(n * sizeof(struct inode_request));
+    if (requests == NULL && n > 0) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        requests[i].inumber = inumbers[i];
+        requests[i].index = i;
+    }
+    qsort(requests, n, sizeof(struct inode_request), inode_comparerequests);
+
+    // With neither a cache nor a mapping to read through, each batch of
+    // blocks is fetched with one scatter/gather read.
+    bool gather = fs->sectorCache == NULL &&
+                  diskimg_getbackend(fs->dfd) != DISKIMG_BACKEND_MMAP;
+    int maxInumber = fs->superblock.s_isize * INODES_PER_BLOCK;
+    for (int i = 0; i < n; ) {
+        int inumber = requests[i].inumber;
+        if (inumber < 1 || inumber > maxInumber) {
+            fprintf(stderr, "Invalid inumber %d\n", inumber);
+            memset(&inodes[requests[i].index], 0, sizeof(struct inode));
+            result = -1;
+            i++;
+            continue;
+        }
+
+        // the next few distinct inode blocks, and where their requests end
+        int blocks[FOREACH_BATCH_BLOCKS];
+        int ends[FOREACH_BATCH_BLOCKS];
+        int numBlocks = 0;
+        int last = i;
+        while (last < n && numBlocks < FOREACH_BATCH_BLOCKS &&
+               requests[last].inumber >= 1 && requests[last].inumber <= maxInumber) {
+            int blockIndex = (requests[last].inumber - 1) / INODES_PER_BLOCK;
+            while (last < n && requests[last].inumber <= maxInumber &&
+                   (requests[last].inumber - 1) / INODES_PER_BLOCK == blockIndex) {
+                last++;
+            }
+            blocks[numBlocks] = blockIndex;
+            ends[numBlocks++] = last;
+        }
+
+        struct inode buf[gather ? numBlocks * INODES_PER_BLOCK : 1];
+        int blocksRead = 0;
+        if (gather) {
+            int sectorNums[numBlocks];
+            struct iovec iov[numBlocks];
+            for (int k = 0; k < numBlocks; k++) {
+                sectorNums[k] = INODE_BLOCK + blocks[k];
+                iov[k].iov_base = &buf[k * INODES_PER_BLOCK];
+                iov[k].iov_len = DISKIMG_SECTOR_SIZE;
+            }
+            int bytes = diskimg_readsectorsv(fs->dfd, sectorNums, iov, numBlocks);
+            blocksRead = bytes > 0 ? bytes / DISKIMG_SECTOR_SIZE : 0;
+        }
+
+        // every request in each block, read once
+        for (int k = 0; k < numBlocks; k++) {
+            const struct inode *block;
+            if (gather) {
+                block = k < blocksRead ? &buf[k * INODES_PER_BLOCK] : NULL;
+            } else {
+                block = unixfilesystem_getsector(fs, INODE_BLOCK + blocks[k]);
+            }
+            for (; i < ends[k]; i++) {
+                struct inode *inp = &inodes[requests[i].index];
+                if (block != NULL) {
+                    *inp = block[(requests[i].inumber - 1) % INODES_PER_BLOCK];
+                } else {
+                    memset(inp, 0, sizeof(struct inode));
+                }
+            }
+            if (block == NULL) {
+                fprintf(stderr, "Error reading in sector. No bytes read\n");
+                result = -1;
+            } else if (!gather) {
+                unixfilesystem_releasesector(fs, block);
+            }
+        }
+    }
+    free(requests);
+    return result;
+}
+
 int inode_getsize(struct inode *inp) {
     return ((inp->i_size0 << (sizeof(inp->i_size1) * CHAR_BIT)) | inp->i_size1);
 }
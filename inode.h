@@ -8,6 +8,10 @@
 
 #include "unixfilesystem.h"
 
+// Block number of a block that was never written (a hole): it reads as
+// zeros, and nothing is stored on disk for it.
+#define INODE_HOLE 0
+
 /**
  * Given the i-number of a file (inumber),this function fetches from
  * disk the inode for that file and stores the inode contents at *inp.
@@ -25,11 +29,65 @@ int inode_iget(const struct unixfilesystem *fs, int inumber,
  * are stored directly in the inode or in indirect blocks. inp points to the
  * inode for the file.  If a disk error occurs when trying to access a block,
  * or if the fileBlockIndex number exceeds the maximum valid value for this
- * inode, this function returns -1.
+ * inode, this function returns -1.  If the block is a hole, including one
+ * whose indirect block is itself missing, this returns INODE_HOLE without
+ * reading anything more.
  */
 int inode_indexlookup(const struct unixfilesystem *fs, struct inode *inp,
         int fileBlockIndex);
 
+/**
+ * Same as inode_indexlookup, but for the file whose inumber is given.  For
+ * large files, the first call reads every indirect block once and caches
+ * the file's whole block map under its inumber; later calls are answered
+ * from memory.  Returns the block number, or -1 on error.
+ */
+int inode_indexlookup_byinumber(const struct unixfilesystem *fs, int inumber,
+        struct inode *inp, int fileBlockIndex);
+
+/**
+ * A run of a file's blocks that are also consecutive on disk: file blocks
+ * fileBlock .. fileBlock + numBlocks - 1 are stored in sectors sector ..
+ * sector + numBlocks - 1.  A run of holes is one extent whose sector is
+ * INODE_HOLE.
+ */
+struct inode_extent {
+    int fileBlock;
+    int sector;
+    int numBlocks;
+};
+
+/**
+ * Computes the extents covering every block of the file whose inode is
+ * inp, in file order, and stores a malloc'd array of them at *extents for
+ * the caller to free.  Returns the number of extents, or -1 if a disk
+ * error occurs reading the indirect blocks.
+ */
+int inode_extents(const struct unixfilesystem *fs, struct inode *inp,
+        struct inode_extent **extents);
+
+/**
+ * Calls fn(inumber, inode, arg) for every allocated inode in the
+ * filesystem, in increasing inumber order.  The inode table is read many
+ * blocks at a time and checked for allocated inodes a whole block at once,
+ * so the free parts of the table cost almost nothing.  If fn returns
+ * nonzero, iteration stops and that value is returned.  Returns 0 once
+ * every inode has been visited, or -1 if a disk error occurs.
+ */
+int inode_foreach_allocated(const struct unixfilesystem *fs,
+        int (*fn)(int inumber, const struct inode *inp, void *arg), void *arg);
+
+/**
+ * Fetches the inodes of the n files listed in inumbers into the matching
+ * elements of inodes.  The inumbers are sorted by the inode block holding
+ * them first, so each block is read once however many of them it holds
+ * and in whatever order they are listed.  An inode that can't be read is
+ * zeroed (so IALLOC is clear).  Returns 0 if every inode was read, or -1
+ * otherwise.
+ */
+int inode_iget_many(const struct unixfilesystem *fs, const int inumbers[], int n,
+        struct inode inodes[]);
+
 /**
  * Given an inode, this function computes the size of its file (in bytes)
  * from the size0 and size1 fields in the inode.
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "inodesnapshot.h"
+#include "inode.h"
+#include "diskimg.h"
+
+static const int INODES_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(struct inode);
+
+// Columns are padded with zeroed elements to a whole number of selection
+// words, so the scans below never need a tail loop.
+#define WORD_BITS 64
+
+static int inodesnapshot_store(int inumber, const struct inode *inp, void *arg) {
+    struct inodesnapshot *snap = arg;
+    int i = inumber - 1;
+    snap->mode[i] = inp->i_mode;
+    snap->nlink[i] = inp->i_nlink;
+    snap->uid[i] = inp->i_uid;
+    snap->gid[i] = inp->i_gid;
+    struct inode copy = *inp;
+    snap->size[i] = inode_getsize(&copy);
+    snap->mtime[i] = ((uint32_t) inp->i_mtime[0] << 16) | inp->i_mtime[1];
+    return 0;
+}
+
+struct inodesnapshot *inodesnapshot_create(const struct unixfilesystem *fs) {
+    struct inodesnapshot *snap = calloc(1, sizeof(struct inodesnapshot));
+    if (snap == NULL) {
+        return NULL;
+    }
+    snap->count = fs->superblock.s_isize * INODES_PER_BLOCK;
+    size_t padded = (size_t) inodesnapshot_selwords(snap) * WORD_BITS;
+    snap->mode = calloc(padded, sizeof(uint16_t));
+    snap->nlink = calloc(padded, sizeof(uint8_t));
+    snap->uid = calloc(padded, sizeof(uint8_t));
+    snap->gid = calloc(padded, sizeof(uint8_t));
+    snap->size = calloc(padded, sizeof(int32_t));
+    snap->mtime = calloc(padded, sizeof(uint32_t));
+    if (snap->mode == NULL || snap->nlink == NULL || snap->uid == NULL ||
+        snap->gid == NULL || snap->size == NULL || snap->mtime == NULL) {
+        inodesnapshot_free(snap);
+        return NULL;
+    }
+
+    // free inodes are left zeroed
+    if (inode_foreach_allocated(fs, inodesnapshot_store, snap) != 0) {
+        inodesnapshot_free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+int inodesnapshot_selwords(const struct inodesnapshot *snap) {
+    return (snap->count + WORD_BITS - 1) / WORD_BITS;
+}
+
+/* Each match function returns a mask with bit i set if element i of the 64
+   starting at col matches.
+ */
+
+static uint64_t match_mode(const uint16_t *col, uint16_t mask, uint16_t value) {
+    uint64_t bits = 0;
+#ifdef __SSE2__
+    __m128i m = _mm_set1_epi16((short) mask);
+    __m128i v = _mm_set1_epi16((short) value);
+    for (int i = 0; i < WORD_BITS; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) &col[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *) &col[i + 8]);
+        lo = _mm_cmpeq_epi16(_mm_and_si128(lo, m), v);
+        hi = _mm_cmpeq_epi16(_mm_and_si128(hi, m), v);
+        bits |= (uint64_t) _mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << i;
+    }
+#else
+    for (int i = 0; i < WORD_BITS; i++) {
+        bits |= (uint64_t) ((col[i] & mask) == value) << i;
+    }
+#endif
+    return bits;
+}
+
+static uint64_t match_byte(const uint8_t *col, uint8_t value) {
+    uint64_t bits = 0;
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi8((char) value);
+    for (int i = 0; i < WORD_BITS; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) &col[i]);
+        bits |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(c, v)) << i;
+    }
+#else
+    for (int i = 0; i < WORD_BITS; i++) {
+        bits |= (uint64_t) (col[i] == value) << i;
+    }
+#endif
+    return bits;
+}
+
+#ifdef __SSE2__
+/* Returns the mask of the 16 int32 elements at col that are neither below
+   lo nor above hi, after adding bias to each element (to compare unsigned
+   values with signed instructions).
+ */
+static unsigned int range_mask16(const int32_t *col, int32_t bias, __m128i lo, __m128i hi) {
+    __m128i b = _mm_set1_epi32(bias);
+    __m128i out[4];
+    for (int j = 0; j < 4; j++) {
+        __m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &col[j * 4]), b);
+        out[j] = _mm_or_si128(_mm_cmplt_epi32(c, lo), _mm_cmpgt_epi32(c, hi));
+    }
+    __m128i packed = _mm_packs_epi16(_mm_packs_epi32(out[0], out[1]),
+                                     _mm_packs_epi32(out[2], out[3]));
+    return ~_mm_movemask_epi8(packed) & 0xffff;
+}
+#endif
+
+static uint64_t match_size(const int32_t *col, int32_t minSize, int32_t maxSize) {
+    uint64_t bits = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi32(minSize);
+    __m128i hi = _mm_set1_epi32(maxSize);
+    for (int i = 0; i < WORD_BITS; i += 16) {
+        bits |= (uint64_t) range_mask16(&col[i], 0, lo, hi) << i;
+    }
+#else
+    for (int i = 0; i < WORD_BITS; i++) {
+        bits |= (uint64_t) (col[i] >= minSize && col[i] <= maxSize) << i;
+    }
+#endif
+    return bits;
+}
+
+static uint64_t match_since(const uint32_t *col, uint32_t since) {
+    uint64_t bits = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi32((int32_t) (since ^ 0x80000000u));
+    __m128i hi = _mm_set1_epi32(INT32_MAX);
+    for (int i = 0; i < WORD_BITS; i += 16) {
+        bits |= (uint64_t) range_mask16((const int32_t *) &col[i], INT32_MIN, lo, hi) << i;
+    }
+#else
+    for (int i = 0; i < WORD_BITS; i++) {
+        bits |= (uint64_t) (col[i] >= since) << i;
+    }
+#endif
+    return bits;
+}
+
+uint64_t *inodesnapshot_select_allocated(const struct inodesnapshot *snap) {
+    int words = inodesnapshot_selwords(snap);
+    uint64_t *sel = malloc((words > 0 ? words : 1) * sizeof(uint64_t));
+    if (sel == NULL) {
+        return NULL;
+    }
+    memset(sel, 0xff, words * sizeof(uint64_t));
+    inodesnapshot_filter_mode(snap, IALLOC, IALLOC, sel);
+    return sel;
+}
+
+void inodesnapshot_filter_mode(const struct inodesnapshot *snap, uint16_t mask,
+                               uint16_t value, uint64_t *sel) {
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        if (sel[w] != 0) {
+            sel[w] &= match_mode(&snap->mode[w * WORD_BITS], mask, value);
+        }
+    }
+}
+
+void inodesnapshot_filter_size(const struct inodesnapshot *snap, int32_t minSize,
+                               int32_t maxSize, uint64_t *sel) {
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        if (sel[w] != 0) {
+            sel[w] &= match_size(&snap->size[w * WORD_BITS], minSize, maxSize);
+        }
+    }
+}
+
+void inodesnapshot_filter_uid(const struct inodesnapshot *snap, uint8_t uid,
+                              uint64_t *sel) {
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        if (sel[w] != 0) {
+            sel[w] &= match_byte(&snap->uid[w * WORD_BITS], uid);
+        }
+    }
+}
+
+void inodesnapshot_filter_gid(const struct inodesnapshot *snap, uint8_t gid,
+                              uint64_t *sel) {
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        if (sel[w] != 0) {
+            sel[w] &= match_byte(&snap->gid[w * WORD_BITS], gid);
+        }
+    }
+}
+
+void inodesnapshot_filter_mtime(const struct inodesnapshot *snap, uint32_t since,
+                                uint64_t *sel) {
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        if (sel[w] != 0) {
+            sel[w] &= match_since(&snap->mtime[w * WORD_BITS], since);
+        }
+    }
+}
+
+int inodesnapshot_count(const struct inodesnapshot *snap, const uint64_t *sel) {
+    int count = 0;
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        count += __builtin_popcountll(sel[w]);
+    }
+    return count;
+}
+
+uint64_t inodesnapshot_sumsize(const struct inodesnapshot *snap, const uint64_t *sel) {
+    uint64_t total = 0;
+    for (int w = 0; w < inodesnapshot_selwords(snap); w++) {
+        for (uint64_t bits = sel[w]; bits != 0; bits &= bits - 1) {
+            total += snap->size[w * WORD_BITS + __builtin_ctzll(bits)];
+        }
+    }
+    return total;
+}
+
+int inodesnapshot_next(const struct inodesnapshot *snap, const uint64_t *sel,
+                       int inumber) {
+    // inumber i + 1 is bit i, so the next inumber's bit is bit inumber
+    int w = inumber / WORD_BITS;
+    if (inumber < 0 || w >= inodesnapshot_selwords(snap)) {
+        return 0;
+    }
+    uint64_t bits = sel[w] & (~(uint64_t) 0 << (inumber % WORD_BITS));
+    while (bits == 0) {
+        if (++w >= inodesnapshot_selwords(snap)) {
+            return 0;
+        }
+        bits = sel[w];
+    }
+    return w * WORD_BITS + __builtin_ctzll(bits) + 1;
+}
+
+void inodesnapshot_free(struct inodesnapshot *snap) {
+    if (snap == NULL) {
+        return;
+    }
+    free(snap->mode);
+    free(snap->nlink);
+    free(snap->uid);
+    free(snap->gid);
+    free(snap->size);
+    free(snap->mtime);
+    free(snap);
+}
@@ -0,0 +1,90 @@
+/* This file defines a column-oriented snapshot of a filesystem's inode
+ * table, for queries that scan every inode.  Each field is decoded once
+ * into its own packed array, indexed by inumber - 1, and the filter and
+ * aggregate functions below scan those arrays with vector instructions.
+ *
+ * Queries work on selections: bitmaps with one bit per inode, held in
+ * inodesnapshot_selwords(snap) 64-bit words.  A query starts from
+ * inodesnapshot_select_allocated and narrows it with filters, e.g.
+ *
+ *     uint64_t *sel = inodesnapshot_select_allocated(snap);
+ *     inodesnapshot_filter_mode(snap, IFMT, 0, sel);     // regular files
+ *     inodesnapshot_filter_size(snap, 1 << 20, INT32_MAX, sel);
+ *     inodesnapshot_filter_uid(snap, 3, sel);
+ *     int n = inodesnapshot_count(snap, sel);
+ */
+
+#ifndef _INODESNAPSHOT_H_
+#define _INODESNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "unixfilesystem.h"
+
+struct inodesnapshot {
+    int count;              // inodes in the table; element i is inumber i + 1
+    uint16_t *mode;
+    uint8_t *nlink;
+    uint8_t *uid;
+    uint8_t *gid;
+    int32_t *size;          // decoded with inode_getsize
+    uint32_t *mtime;        // seconds since the epoch
+};
+
+/**
+ * Reads the whole inode table of fs and decodes it into a new snapshot.
+ * Returns NULL on error.
+ */
+struct inodesnapshot *inodesnapshot_create(const struct unixfilesystem *fs);
+
+/**
+ * Returns the number of 64-bit words in a selection for snap.
+ */
+int inodesnapshot_selwords(const struct inodesnapshot *snap);
+
+/**
+ * Returns a new selection, to be freed by the caller, holding every
+ * allocated inode.  Returns NULL if out of memory.
+ */
+uint64_t *inodesnapshot_select_allocated(const struct inodesnapshot *snap);
+
+/**
+ * Each filter removes from sel the inodes that don't match:
+ * filter_mode keeps inodes with (mode & mask) == value, filter_size those
+ * with minSize <= size <= maxSize, filter_uid and filter_gid those with the
+ * given owner or group, and filter_mtime those modified at or after since.
+ */
+void inodesnapshot_filter_mode(const struct inodesnapshot *snap, uint16_t mask,
+                               uint16_t value, uint64_t *sel);
+void inodesnapshot_filter_size(const struct inodesnapshot *snap, int32_t minSize,
+                               int32_t maxSize, uint64_t *sel);
+void inodesnapshot_filter_uid(const struct inodesnapshot *snap, uint8_t uid,
+                              uint64_t *sel);
+void inodesnapshot_filter_gid(const struct inodesnapshot *snap, uint8_t gid,
+                              uint64_t *sel);
+void inodesnapshot_filter_mtime(const struct inodesnapshot *snap, uint32_t since,
+                                uint64_t *sel);
+
+/**
+ * Returns the number of inodes in sel.
+ */
+int inodesnapshot_count(const struct inodesnapshot *snap, const uint64_t *sel);
+
+/**
+ * Returns the total size in bytes of the inodes in sel.
+ */
+uint64_t inodesnapshot_sumsize(const struct inodesnapshot *snap, const uint64_t *sel);
+
+/**
+ * Returns the smallest inumber in sel greater than inumber, or 0 if there
+ * is none.  Start from 0 to visit every selected inode.
+ */
+int inodesnapshot_next(const struct inodesnapshot *snap, const uint64_t *sel,
+                       int inumber);
+
+/**
+ * Frees the snapshot.
+ */
+void inodesnapshot_free(struct inodesnapshot *snap);
+
+#endif // _INODESNAPSHOT_H_
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "inodetable.h"
+#include "unixfilesystem.h"
+#include "diskimg.h"
+
+static const int INODES_PER_BLOCK = DISKIMG_SECTOR_SIZE / sizeof(struct inode);
+
+struct inodetable {
+    int dfd;
+    int numBlocks;
+    int numChunks;
+    struct inode *inodes;       // numBlocks * INODES_PER_BLOCK inodes
+    bool *chunkLoaded;          // set with release ordering once filled
+    pthread_mutex_t lock;       // serializes chunk loads
+};
+
+/* Reads inode blocks [first, first + count) into the table with one read.
+   Returns 0 on success, or -1 on error.
+ */
+static int inodetable_read(struct inodetable *table, int first, int count) {
+    int bytes = diskimg_readsectors(table->dfd, INODE_START_SECTOR + first, count,
+                                    &table->inodes[first * INODES_PER_BLOCK]);
+    if (bytes != count * DISKIMG_SECTOR_SIZE) {
+        fprintf(stderr, "Error reading inode blocks %d-%d\n", first, first + count - 1);
+        return -1;
+    }
+    return 0;
+}
+
+struct inodetable *inodetable_create(int dfd, int numBlocks, int lazy) {
+    if (numBlocks <= 0) {
+        return NULL;
+    }
+
+    struct inodetable *table = calloc(1, sizeof(struct inodetable));
+    if (table == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    table->dfd = dfd;
+    table->numBlocks = numBlocks;
+    table->numChunks = (numBlocks + INODETABLE_CHUNK_BLOCKS - 1) / INODETABLE_CHUNK_BLOCKS;
+    table->inodes = malloc((size_t) numBlocks * DISKIMG_SECTOR_SIZE);
+    table->chunkLoaded = calloc(table->numChunks, sizeof(bool));
+    if (table->inodes == NULL || table->chunkLoaded == NULL) {
+        inodetable_free(table);
+        return NULL;
+    }
+
+    if (!lazy) {
+        if (inodetable_read(table, 0, numBlocks) != 0) {
+            inodetable_free(table);
+            return NULL;
+        }
+        for (int i = 0; i < table->numChunks; i++) {
+            table->chunkLoaded[i] = true;
+        }
+    }
+    return table;
+}
+
+const struct inode *inodetable_block(struct inodetable *table, int blockIndex) {
+    if (blockIndex < 0 || blockIndex >= table->numBlocks) {
+        return NULL;
+    }
+
+    int chunk = blockIndex / INODETABLE_CHUNK_BLOCKS;
+    if (!__atomic_load_n(&table->chunkLoaded[chunk], __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&table->lock);
+        if (!table->chunkLoaded[chunk]) {
+            int first = chunk * INODETABLE_CHUNK_BLOCKS;
+            int count = table->numBlocks - first;
+            if (count > INODETABLE_CHUNK_BLOCKS) {
+                count = INODETABLE_CHUNK_BLOCKS;
+            }
+            if (inodetable_read(table, first, count) != 0) {
+                pthread_mutex_unlock(&table->lock);
+                return NULL;
+            }
+            __atomic_store_n(&table->chunkLoaded[chunk], true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&table->lock);
+    }
+    return &table->inodes[blockIndex * INODES_PER_BLOCK];
+}
+
+int inodetable_numblocks(const struct inodetable *table) {
+    return table->numBlocks;
+}
+
+void inodetable_free(struct inodetable *table) {
+    if (table == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->chunkLoaded);
+    free(table->inodes);
+    free(table);
+}
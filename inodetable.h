@@ -0,0 +1,40 @@
+/* This file defines an in-memory copy of a filesystem's inode table.  It
+ * is either read in full with a single sequential read when created, or
+ * filled in lazily, a chunk of blocks at a time, as inodes are asked for.
+ */
+
+#ifndef _INODETABLE_H_
+#define _INODETABLE_H_
+
+#include "ino.h"
+
+// Inode blocks read at once when a table is filled lazily.
+#define INODETABLE_CHUNK_BLOCKS 64
+
+struct inodetable;
+
+/**
+ * Creates a table for the numBlocks inode blocks of the disk image dfd.
+ * If lazy is zero, the whole table is read now; otherwise chunks are read
+ * on first use.  Returns NULL on error.
+ */
+struct inodetable *inodetable_create(int dfd, int numBlocks, int lazy);
+
+/**
+ * Returns the inodes stored in inode block blockIndex (0 is the first
+ * block of the table), reading that block's chunk if it isn't loaded yet.
+ * Returns NULL if blockIndex is out of range or the read fails.
+ */
+const struct inode *inodetable_block(struct inodetable *table, int blockIndex);
+
+/**
+ * Returns the number of inode blocks the table covers.
+ */
+int inodetable_numblocks(const struct inodetable *table);
+
+/**
+ * Frees the table.
+ */
+void inodetable_free(struct inodetable *table);
+
+#endif // _INODETABLE_H_
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "lru.h"
+
+#define LRU_MIN_BUCKETS 16
+
+// Strictest alignment a value might need (union lru_align is C11).
+union lru_align {
+    long double ld;
+    long long ll;
+    void *p;
+};
+
+/* Each entry is a single allocation: the header, then the value (aligned
+   for any type), then the key bytes.  An entry is on exactly one of two
+   lists while it is cached: the LRU list if only the cache references it,
+   or the in-use list if a caller has it pinned.
+ */
+struct lru_entry {
+    struct lru_entry *hashNext;
+    struct lru_entry *prev, *next;
+    uint32_t hash;
+    bool inCache;
+    int refs;               // pins, plus one while inCache
+    size_t charge;
+    size_t keyLen;
+    union lru_align data[];
+};
+
+struct lru {
+    pthread_mutex_t lock;
+    size_t capacity;
+    size_t valueSize;
+    size_t valueStride;     // valueSize rounded up so the key stays aligned
+    void (*destroy)(void *value);
+
+    struct lru_entry **buckets;
+    size_t numBuckets;      // always a power of two
+
+    struct lru_entry lruList;   // sentinel; next is the oldest entry
+    struct lru_entry inUseList; // sentinel
+
+    struct lru_stats stats;
+};
+
+static void *entry_value(struct lru_entry *e) {
+    return e->data;
+}
+
+static char *entry_key(struct lru *lru, struct lru_entry *e) {
+    return (char *) e->data + lru->valueStride;
+}
+
+static struct lru_entry *value_entry(void *value) {
+    return (struct lru_entry *) ((char *) value - offsetof(struct lru_entry, data));
+}
+
+// FNV-1a
+static uint32_t lru_hash(const void *key, size_t keyLen) {
+    const uint8_t *p = key;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < keyLen; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void list_remove(struct lru_entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void list_append(struct lru_entry *list, struct lru_entry *e) {
+    e->next = list;
+    e->prev = list->prev;
+    e->prev->next = e;
+    list->prev = e;
+}
+
+static struct lru_entry **lru_findslot(struct lru *lru, const void *key,
+                                       size_t keyLen, uint32_t hash) {
+    struct lru_entry **slot = &lru->buckets[hash & (lru->numBuckets - 1)];
+    while (*slot != NULL &&
+           ((*slot)->hash != hash || (*slot)->keyLen != keyLen ||
+            memcmp(entry_key(lru, *slot), key, keyLen) != 0)) {
+        slot = &(*slot)->hashNext;
+    }
+    return slot;
+}
+
+/* Doubles the bucket array.  Failure is harmless; chains just get longer. */
+static void lru_grow(struct lru *lru) {
+    size_t numBuckets = lru->numBuckets * 2;
+    struct lru_entry **buckets = calloc(numBuckets, sizeof(struct lru_entry *));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < lru->numBuckets; i++) {
+        struct lru_entry *e = lru->buckets[i];
+        while (e != NULL) {
+            struct lru_entry *next = e->hashNext;
+            struct lru_entry **slot = &buckets[e->hash & (numBuckets - 1)];
+            e->hashNext = *slot;
+            *slot = e;
+            e = next;
+        }
+    }
+    free(lru->buckets);
+    lru->buckets = buckets;
+    lru->numBuckets = numBuckets;
+}
+
+static void lru_unref(struct lru *lru, struct lru_entry *e) {
+    e->refs--;
+    if (e->refs == 0) {
+        if (lru->destroy != NULL) {
+            lru->destroy(entry_value(e));
+        }
+        free(e);
+    } else if (e->refs == 1 && e->inCache) {
+        // Only the cache holds it now, so it becomes evictable.
+        list_remove(e);
+        list_append(&lru->lruList, e);
+    }
+}
+
+static void lru_ref(struct lru *lru, struct lru_entry *e) {
+    if (e->refs == 1 && e->inCache) {
+        list_remove(e);
+        list_append(&lru->inUseList, e);
+    }
+    e->refs++;
+}
+
+/* Takes an entry out of the table and its list, dropping the cache's
+   reference.  *slot must point at the entry.
+ */
+static void lru_detach(struct lru *lru, struct lru_entry **slot) {
+    struct lru_entry *e = *slot;
+    *slot = e->hashNext;
+    list_remove(e);
+    e->inCache = false;
+    lru->stats.entries--;
+    lru->stats.charge -= e->charge;
+    lru_unref(lru, e);
+}
+
+static void lru_evict(struct lru *lru) {
+    while (lru->stats.charge > lru->capacity &&
+           lru->lruList.next != &lru->lruList) {
+        struct lru_entry *oldest = lru->lruList.next;
+        lru_detach(lru, lru_findslot(lru, entry_key(lru, oldest),
+                                     oldest->keyLen, oldest->hash));
+        lru->stats.evictions++;
+    }
+}
+
+struct lru *lru_create(size_t capacity, size_t valueSize,
+                       void (*destroy)(void *value)) {
+    struct lru *lru = calloc(1, sizeof(struct lru));
+    if (lru == NULL) {
+        return NULL;
+    }
+    lru->numBuckets = LRU_MIN_BUCKETS;
+    lru->buckets = calloc(lru->numBuckets, sizeof(struct lru_entry *));
+    if (lru->buckets == NULL) {
+        free(lru);
+        return NULL;
+    }
+
+    pthread_mutex_init(&lru->lock, NULL);
+    lru->capacity = capacity;
+    lru->valueSize = valueSize;
+    lru->valueStride = (valueSize + sizeof(union lru_align) - 1) &
+                       ~(sizeof(union lru_align) - 1);
+    lru->destroy = destroy;
+    lru->lruList.next = lru->lruList.prev = &lru->lruList;
+    lru->inUseList.next = lru->inUseList.prev = &lru->inUseList;
+    lru->stats.capacity = capacity;
+    return lru;
+}
+
+int lru_get(struct lru *lru, const void *key, size_t keyLen, void *out) {
+    pthread_mutex_lock(&lru->lock);
+    struct lru_entry *e = *lru_findslot(lru, key, keyLen, lru_hash(key, keyLen));
+    if (e == NULL) {
+        lru->stats.misses++;
+        pthread_mutex_unlock(&lru->lock);
+        return 0;
+    }
+
+    lru->stats.hits++;
+    memcpy(out, entry_value(e), lru->valueSize);
+    if (e->refs == 1) {
+        // Move to the most-recently-used end.
+        list_remove(e);
+        list_append(&lru->lruList, e);
+    }
+    pthread_mutex_unlock(&lru->lock);
+    return 1;
+}
+
+int lru_contains(struct lru *lru, const void *key, size_t keyLen) {
+    pthread_mutex_lock(&lru->lock);
+    int found = *lru_findslot(lru, key, keyLen, lru_hash(key, keyLen)) != NULL;
+    pthread_mutex_unlock(&lru->lock);
+    return found;
+}
+
+void *lru_lookup(struct lru *lru, const void *key, size_t keyLen) {
+    pthread_mutex_lock(&lru->lock);
+    struct lru_entry *e = *lru_findslot(lru, key, keyLen, lru_hash(key, keyLen));
+    void *value = NULL;
+    if (e == NULL) {
+        lru->stats.misses++;
+    } else {
+        lru->stats.hits++;
+        lru_ref(lru, e);
+        value = entry_value(e);
+    }
+    pthread_mutex_unlock(&lru->lock);
+    return value;
+}
+
+void *lru_insert(struct lru *lru, const void *key, size_t keyLen,
+                 const void *value, size_t charge) {
+    struct lru_entry *e = malloc(sizeof(struct lru_entry) + lru->valueStride + keyLen);
+    if (e == NULL) {
+        return NULL;
+    }
+    memcpy(entry_value(e), value, lru->valueSize);
+    memcpy(entry_key(lru, e), key, keyLen);
+    e->hash = lru_hash(key, keyLen);
+    e->keyLen = keyLen;
+    e->charge = charge;
+    e->refs = 1;            // the caller's pin
+    e->inCache = false;
+    e->hashNext = NULL;
+
+    pthread_mutex_lock(&lru->lock);
+    if (lru->capacity > 0) {
+        struct lru_entry **slot = lru_findslot(lru, key, keyLen, e->hash);
+        if (*slot != NULL) {
+            lru_detach(lru, slot);
+        }
+
+        e->inCache = true;
+        e->refs++;
+        e->hashNext = *slot;
+        *slot = e;
+        list_append(&lru->inUseList, e);
+        lru->stats.entries++;
+        lru->stats.charge += charge;
+        if (lru->stats.entries > lru->numBuckets) {
+            lru_grow(lru);
+        }
+        lru_evict(lru);
+    }
+    pthread_mutex_unlock(&lru->lock);
+    return entry_value(e);
+}
+
+void lru_release(struct lru *lru, void *value) {
+    pthread_mutex_lock(&lru->lock);
+    lru_unref(lru, value_entry(value));
+    lru_evict(lru);     // it may have been pinned while over capacity
+    pthread_mutex_unlock(&lru->lock);
+}
+
+void lru_erase(struct lru *lru, const void *key, size_t keyLen) {
+    pthread_mutex_lock(&lru->lock);
+    struct lru_entry **slot = lru_findslot(lru, key, keyLen, lru_hash(key, keyLen));
+    if (*slot != NULL) {
+        lru_detach(lru, slot);
+    }
+    pthread_mutex_unlock(&lru->lock);
+}
+
+void lru_getstats(struct lru *lru, struct lru_stats *stats) {
+    pthread_mutex_lock(&lru->lock);
+    *stats = lru->stats;
+    pthread_mutex_unlock(&lru->lock);
+}
+
+void lru_free(struct lru *lru) {
+    if (lru == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < lru->numBuckets; i++) {
+        struct lru_entry *e = lru->buckets[i];
+        while (e != NULL) {
+            struct lru_entry *next = e->hashNext;
+            if (lru->destroy != NULL) {
+                lru->destroy(entry_value(e));
+            }
+            free(e);
+            e = next;
+        }
+    }
+    pthread_mutex_destroy(&lru->lock);
+    free(lru->buckets);
+    free(lru);
+}
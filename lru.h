@@ -0,0 +1,81 @@
+/* This file defines a bounded, thread-safe cache with least-recently-used
+ * eviction.  Keys are arbitrary byte strings and values are fixed-size
+ * records copied into the cache.  Lookup, insertion and eviction are all
+ * O(1).  The filesystem layers use it for every in-memory cache they keep.
+ */
+
+#ifndef _LRU_H_
+#define _LRU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct lru;
+
+struct lru_stats {
+    uint64_t hits;          // lookups that found their key
+    uint64_t misses;        // lookups that didn't
+    uint64_t evictions;     // entries dropped to stay within capacity
+    size_t entries;         // entries currently cached
+    size_t charge;          // total charge of cached entries
+    size_t capacity;        // maximum total charge
+};
+
+/**
+ * Creates a cache holding at most capacity units of charge (see
+ * lru_insert) of values that are valueSize bytes each.  destroy, if not
+ * NULL, is called on a value just before it is freed.  A capacity of 0
+ * creates a cache that never retains anything.  Returns NULL on error.
+ */
+struct lru *lru_create(size_t capacity, size_t valueSize,
+                       void (*destroy)(void *value));
+
+/**
+ * Looks up key and, if found, copies its value to out and returns 1.
+ * Returns 0 if the key isn't cached.
+ */
+int lru_get(struct lru *lru, const void *key, size_t keyLen, void *out);
+
+/**
+ * Returns 1 if key is cached and 0 otherwise, without counting a hit or
+ * miss or refreshing the entry.
+ */
+int lru_contains(struct lru *lru, const void *key, size_t keyLen);
+
+/**
+ * Looks up key and returns a pointer to its value, or NULL if it isn't
+ * cached.  The entry is pinned: it won't be freed until it is handed back
+ * with lru_release, even if it is evicted or replaced meanwhile.
+ */
+void *lru_lookup(struct lru *lru, const void *key, size_t keyLen);
+
+/**
+ * Copies value into the cache under key, replacing any previous entry, and
+ * evicts least-recently-used entries until the total charge fits the
+ * capacity again.  Returns the cached value, pinned as for lru_lookup, or
+ * NULL if out of memory.
+ */
+void *lru_insert(struct lru *lru, const void *key, size_t keyLen,
+                 const void *value, size_t charge);
+
+/**
+ * Unpins a value returned by lru_lookup or lru_insert.
+ */
+void lru_release(struct lru *lru, void *value);
+
+/**
+ * Drops the entry for key, if any.
+ */
+void lru_erase(struct lru *lru, const void *key, size_t keyLen);
+
+/**
+ * Fills in *stats with the cache's counters and current occupancy.
+ */
+void lru_getstats(struct lru *lru, struct lru_stats *stats);
+
+/**
+ * Frees the cache and every value in it.  No values may still be pinned.
+ */
+void lru_free(struct lru *lru);
+
+#endif // _LRU_H_
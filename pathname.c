@@ -2,21 +2,63 @@
 #include "directory.h"
 #include "inode.h"
 #include "diskimg.h"
+#include "lru.h"
+#include "file.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ROOT_DIR_INUMBER 1
 
-/* This function which looks up an absolute path (you can assume it is absolute,
-   meaning starts with a "/") and returns the i-number for the file specified by 
-   the path.
+/* Key of a dentry cache entry.  The name is NUL-padded to its full
+   length so that names directory_findname treats alike share an entry.
  */
-int pathname_lookup(const struct unixfilesystem *fs, const char *pathname) {
+struct pathname_dentkey {
+    int parent;
+    char name[MAX_COMPONENT_LENGTH];
+};
+
+/* Looks up one component of a path in directory dirinumber, through the
+   dentry cache.  Returns the entry's inumber, -1 if the directory doesn't
+   contain the name, or -2 on error.  Only errors aren't cached.
+ */
+static int pathname_step(const struct unixfilesystem *fs, int dirinumber,
+                         const char *name) {
+    struct pathname_dentkey key;
+    memset(&key, 0, sizeof(key));
+    key.parent = dirinumber;
+    memcpy(key.name, name, directory_namelen(name));
+
+    int inumber;
+    if (fs->dentryCache != NULL &&
+        lru_get(fs->dentryCache, &key, sizeof(key), &inumber)) {
+        return inumber;
+    }
+
+    struct direntv6 dirEnt;
+    int found = directory_lookup(fs, name, dirinumber, &dirEnt);
+    if (found < 0) {
+        return -2;
+    }
+    inumber = found ? dirEnt.d_inumber : -1;
+    if (fs->dentryCache != NULL) {
+        void *cached = lru_insert(fs->dentryCache, &key, sizeof(key), &inumber, 1);
+        if (cached != NULL) {
+            lru_release(fs->dentryCache, cached);
+        }
+    }
+    return inumber;
+}
+
+/* This function walks the path one component at a time.  It returns the
+   i-number for the file specified by the path, -1 if a component doesn't
+   exist, or -2 on error.
+ */
+static int pathname_walk(const struct unixfilesystem *fs, const char *pathname) {
     // cast pathname as char *
     size_t pathnameSize = strlen(pathname);
     char pathCopy[pathnameSize + 1];
-    pathCopy[pathnameSize] = '\0';
-    strncpy(pathCopy, pathname, pathnameSize);
+    memcpy(pathCopy, pathname, pathnameSize + 1);
     char *filepath = &pathCopy[0];
 
     // start at root node
@@ -24,21 +66,247 @@ int pathname_lookup(const struct unixfilesystem *fs, const char *pathname) {
     char *dirname = strsep(&filepath, delim);
     int dirinumber = ROOT_DIR_INUMBER;
     while ((dirname = strsep(&filepath, delim)) != NULL) {
-        struct direntv6 dirEnt;
-
         // edge case: if dirname is the empty string, return dirinumber
         if (strcmp(dirname, "") == 0) {
             return dirinumber;
         }
 
-        if (directory_findname(fs, dirname, dirinumber, &dirEnt) == -1) {
-            fprintf(stderr, "Invalid directory path. Name not found in directory.\n");
-            return -1;
-        }
-
         // update new dirinumber after finding next dirEnt
-        dirinumber = dirEnt.d_inumber;
+        dirinumber = pathname_step(fs, dirinumber, dirname);
+        if (dirinumber < 0) {
+            return dirinumber;
+        }
     }
 
     return dirinumber;
 }
+
+/* This function which looks up an absolute path (you can assume it is absolute,
+   meaning starts with a "/") and returns the i-number for the file specified by 
+   the path.  Whole paths, found or not, are remembered in the path cache.
+ */
+int pathname_lookup(const struct unixfilesystem *fs, const char *pathname) {
+    size_t pathnameSize = strlen(pathname);
+    int inumber;
+    if (fs->pathCache == NULL ||
+        !lru_get(fs->pathCache, pathname, pathnameSize, &inumber)) {
+        inumber = pathname_walk(fs, pathname);
+        if (inumber != -2 && fs->pathCache != NULL) {
+            void *cached = lru_insert(fs->pathCache, pathname, pathnameSize,
+                                      &inumber, 1);
+            if (cached != NULL) {
+                lru_release(fs->pathCache, cached);
+            }
+        }
+    }
+
+    if (inumber < 0) {
+        fprintf(stderr, "Invalid directory path. Name not found in directory.\n");
+        return -1;
+    }
+    return inumber;
+}
+
+/* A component of a path in a batch, as a node of the batch's trie.  key is
+   NUL-padded like a dentry cache key; inumber is -1 until found.
+ */
+struct pathname_node {
+    char key[MAX_COMPONENT_LENGTH];
+    int parent;
+    int inumber;
+};
+
+/* A path of a batch and where it came from in the caller's array. */
+struct pathname_item {
+    const char *path;
+    int index;
+};
+
+/* Trie children of a batch, sorted by parent and then key. */
+struct pathname_child {
+    int parent;
+    char key[MAX_COMPONENT_LENGTH];
+    int node;
+};
+
+/* Orders paths component by component, so that every path under a
+   directory sorts together even when a sibling's name continues with a
+   byte below '/'.
+ */
+static int pathname_compareitems(const void *a, const void *b) {
+    const unsigned char *p = (const unsigned char *) ((const struct pathname_item *) a)->path;
+    const unsigned char *q = (const unsigned char *) ((const struct pathname_item *) b)->path;
+    for (;; p++, q++) {
+        unsigned int x = *p == '/' ? 1 : *p == '\0' ? 0 : *p + 1u;
+        unsigned int y = *q == '/' ? 1 : *q == '\0' ? 0 : *q + 1u;
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+        if (x == 0) {
+            return 0;
+        }
+    }
+}
+
+static int pathname_comparechildren(const void *a, const void *b) {
+    const struct pathname_child *x = a;
+    const struct pathname_child *y = b;
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
+    }
+    return memcmp(x->key, y->key, MAX_COMPONENT_LENGTH);
+}
+
+/* Reads directory dirinumber once and resolves the count children wanted
+   from it (sorted by key), taking the first entry with each name as
+   directory_findname does.  Children that aren't found keep inumber -1.
+ */
+static void pathname_scan(const struct unixfilesystem *fs, int dirinumber,
+                          const struct pathname_child *kids, int count,
+                          struct pathname_node *nodes) {
+    struct file *fp = file_open(fs, dirinumber);
+    if (fp == NULL) {
+        return;
+    }
+
+    int remaining = count;
+    for (int i = 0; remaining > 0 && i * DISKIMG_SECTOR_SIZE < file_getsize(fp); i++) {
+        struct direntv6 buf[DISKIMG_SECTOR_SIZE / sizeof(struct direntv6)];
+        int blockSize = file_handle_getblock(fp, i, buf);
+        if (blockSize == -1) {
+            fprintf(stderr, "Error getting block at index %d\n", i);
+            break;
+        }
+
+        int numDir = blockSize / sizeof(struct direntv6);
+        for (int j = 0; remaining > 0 && j < numDir; j++) {
+            struct pathname_child want;
+            memset(&want, 0, sizeof(want));
+            want.parent = kids[0].parent;
+            memcpy(want.key, buf[j].d_name, directory_entnamelen(&buf[j]));
+            const struct pathname_child *kid = bsearch(&want, kids, count, sizeof(want),
+                                                       pathname_comparechildren);
+            if (kid == NULL || nodes[kid->node].inumber != -1) {
+                continue;
+            }
+
+            // the same name may be in the trie more than once
+            while (kid > kids && pathname_comparechildren(kid - 1, &want) == 0) {
+                kid--;
+            }
+            for (; kid < kids + count && pathname_comparechildren(kid, &want) == 0; kid++) {
+                nodes[kid->node].inumber = buf[j].d_inumber;
+                remaining--;
+            }
+        }
+    }
+    file_close(fp);
+}
+
+int pathname_lookup_many(const struct unixfilesystem *fs, const char *paths[],
+                         int n, int inumbers[]) {
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t maxDepth = 0;
+    size_t maxNodes = 1;
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(paths[i]);
+        maxNodes += len / 2 + 1;
+        if (len / 2 + 1 > maxDepth) {
+            maxDepth = len / 2 + 1;
+        }
+    }
+
+    struct pathname_item *items = malloc(n * sizeof(struct pathname_item));
+    int *pathNode = malloc(n * sizeof(int));
+    int *chain = malloc(maxDepth * sizeof(int));
+    struct pathname_node *nodes = malloc(maxNodes * sizeof(struct pathname_node));
+    struct pathname_child *kids = malloc(maxNodes * sizeof(struct pathname_child));
+    if (items == NULL || pathNode == NULL || chain == NULL || nodes == NULL || kids == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        free(items);
+        free(pathNode);
+        free(chain);
+        free(nodes);
+        free(kids);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        items[i].path = paths[i];
+        items[i].index = i;
+    }
+    qsort(items, n, sizeof(struct pathname_item), pathname_compareitems);
+
+    // Build the trie.  Sorted paths that share leading components are
+    // adjacent, so each path only has to be compared with the one before
+    // it.  Like pathname_lookup, everything up to the first '/' is ignored
+    // and an empty component ends the path.
+    memset(&nodes[0], 0, sizeof(struct pathname_node));
+    nodes[0].parent = -1;
+    nodes[0].inumber = ROOT_DIR_INUMBER;
+    int numNodes = 1;
+    int prevDepth = 0;
+    for (int i = 0; i < n; i++) {
+        int node = 0;
+        int depth = 0;
+        const char *component = strchr(items[i].path, '/');
+        while (component != NULL) {
+            component++;
+            size_t len = strcspn(component, "/");
+            if (len == 0) {
+                break;
+            }
+
+            char key[MAX_COMPONENT_LENGTH];
+            memset(key, 0, sizeof(key));
+            memcpy(key, component, len < MAX_COMPONENT_LENGTH ? len : MAX_COMPONENT_LENGTH);
+            if (depth < prevDepth && memcmp(nodes[chain[depth]].key, key, sizeof(key)) == 0) {
+                node = chain[depth];
+            } else {
+                prevDepth = depth;
+                memcpy(nodes[numNodes].key, key, sizeof(key));
+                nodes[numNodes].parent = node;
+                nodes[numNodes].inumber = -1;
+                node = numNodes++;
+            }
+            chain[depth++] = node;
+            component = strchr(component, '/');
+        }
+        prevDepth = depth;
+        pathNode[items[i].index] = node;
+    }
+
+    // Group children by parent.  Nodes are numbered parents first, so
+    // walking the groups in order resolves every directory before its
+    // children are looked up in it.
+    for (int i = 1; i < numNodes; i++) {
+        kids[i - 1].parent = nodes[i].parent;
+        memcpy(kids[i - 1].key, nodes[i].key, MAX_COMPONENT_LENGTH);
+        kids[i - 1].node = i;
+    }
+    qsort(kids, numNodes - 1, sizeof(struct pathname_child), pathname_comparechildren);
+    for (int first = 0; first < numNodes - 1; ) {
+        int last = first;
+        while (last < numNodes - 1 && kids[last].parent == kids[first].parent) {
+            last++;
+        }
+        if (nodes[kids[first].parent].inumber != -1) {
+            pathname_scan(fs, nodes[kids[first].parent].inumber, &kids[first],
+                          last - first, nodes);
+        }
+        first = last;
+    }
+
+    for (int i = 0; i < n; i++) {
+        inumbers[i] = nodes[pathNode[i]].inumber;
+    }
+    free(items);
+    free(pathNode);
+    free(chain);
+    free(nodes);
+    free(kids);
+    return 0;
+}
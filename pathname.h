@@ -11,4 +11,14 @@
  */
 int pathname_lookup(const struct unixfilesystem *fs, const char *pathname);
 
+/**
+ * Looks up the n absolute paths in paths and stores the inumber of each
+ * at the same index of inumbers, or -1 if it isn't valid, as
+ * pathname_lookup would return.  Paths are merged into a trie of their
+ * components, so each directory on the way is read once for all the names
+ * wanted from it.  Returns 0 on success, or -1 if out of memory.
+ */
+int pathname_lookup_many(const struct unixfilesystem *fs, const char *paths[],
+                         int n, int inumbers[]);
+
 #endif // _PATHNAME_H_
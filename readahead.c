@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "readahead.h"
+#include "diskimg.h"
+#include "diskimg_aio.h"
+#include "lru.h"
+
+#define READAHEAD_STREAMS     16   // files tracked at once
+#define READAHEAD_MIN_WINDOW   4
+
+/* Where one reader is in one file.  next is the block we expect it to read
+   next, ahead is the first block not yet prefetched, and reaching trigger
+   starts the next window.
+ */
+struct readahead_stream {
+    int inumber;
+    int next;
+    int ahead;
+    int trigger;
+    int window;
+};
+
+/* A run of adjacent sectors being read into slots firstSlot .. firstSlot +
+   count - 1 of the readahead buffer.  count is 0 once it's harvested.
+ */
+struct readahead_run {
+    int firstSector;
+    int firstSlot;
+    int count;
+};
+
+struct readahead {
+    pthread_mutex_t lock;
+    int dfd;
+    int maxWindow;
+    struct readahead_stream streams[READAHEAD_STREAMS];
+    int nextSlot;               // stream slot to recycle next
+
+    // Used only under fillLock.  Prefetches stay in flight after
+    // readahead_fill returns; finished ones are copied into the cache by
+    // the next fill, or by readahead_wait when a reader needs one of them.
+    pthread_mutex_t fillLock;
+    struct diskimg_aio *aio;
+    uint8_t *buf;               // maxWindow sectors, one per slot
+    int *slotSector;            // sector being read into each slot, or -1
+    int *slotRun;               // run each busy slot belongs to
+    struct readahead_run *runs; // maxWindow runs, indexed by aio tag
+};
+
+struct readahead *readahead_create(int dfd, int maxWindow) {
+    if (maxWindow < READAHEAD_MIN_WINDOW) {
+        return NULL;
+    }
+
+    struct readahead *ra = calloc(1, sizeof(struct readahead));
+    if (ra == NULL) {
+        return NULL;
+    }
+    ra->buf = malloc((size_t) maxWindow * DISKIMG_SECTOR_SIZE);
+    ra->slotSector = malloc(maxWindow * sizeof(int));
+    ra->slotRun = malloc(maxWindow * sizeof(int));
+    ra->runs = calloc(maxWindow, sizeof(struct readahead_run));
+    if (ra->buf == NULL || ra->slotSector == NULL || ra->slotRun == NULL ||
+        ra->runs == NULL) {
+        free(ra->buf);
+        free(ra->slotSector);
+        free(ra->slotRun);
+        free(ra->runs);
+        free(ra);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_mutex_init(&ra->fillLock, NULL);
+    ra->dfd = dfd;
+    ra->maxWindow = maxWindow;
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        ra->streams[i].inumber = -1;
+    }
+    for (int i = 0; i < maxWindow; i++) {
+        ra->slotSector[i] = -1;
+    }
+    return ra;
+}
+int readahead_advise(struct readahead *ra, int inumber, int fileBlockIndex,
+                     int numBlocks, int *start) {
+    pthread_mutex_lock(&ra->lock);
+    struct readahead_stream *st = NULL;
+    for (int i = 0; i < READAHEAD_STREAMS; i++) {
+        if (ra->streams[i].inumber == inumber) {
+            st = &ra->streams[i];
+            break;
+        }
+    }
+
+    int count = 0;
+    if (st != NULL && fileBlockIndex == st->next) {
+        if (fileBlockIndex >= st->trigger && st->ahead < numBlocks) {
+            if (st->ahead <= fileBlockIndex) {
+                st->ahead = fileBlockIndex + 1;
+            }
+            count = st->window;
+            if (count > numBlocks - st->ahead) {
+                count = numBlocks - st->ahead;
+            }
+            *start = st->ahead;
+            st->trigger = st->ahead;
+            st->ahead += count;
+            st->window *= 2;
+            if (st->window > ra->maxWindow) {
+                st->window = ra->maxWindow;
+            }
+        }
+    } else {
+        // New or random access: start over with a small window that the
+        // very next sequential read will trigger.
+        if (st == NULL) {
+            st = &ra->streams[ra->nextSlot];
+            ra->nextSlot = (ra->nextSlot + 1) % READAHEAD_STREAMS;
+            st->inumber = inumber;
+        }
+        st->ahead = fileBlockIndex + 1;
+        st->trigger = fileBlockIndex + 1;
+        st->window = READAHEAD_MIN_WINDOW;
+    }
+    st->next = fileBlockIndex + 1;
+    pthread_mutex_unlock(&ra->lock);
+    return count;
+}
+
+/* Copies the sectors of a finished run that were read in full into the
+   cache and frees its slots.  Caller holds fillLock.
+ */
+static void readahead_harvest(struct readahead *ra, struct lru *cache, int r,
+                              int result) {
+    struct readahead_run *run = &ra->runs[r];
+    for (int j = 0; j < run->count; j++) {
+        int slot = run->firstSlot + j;
+        if ((j + 1) * DISKIMG_SECTOR_SIZE <= result) {
+            int sector = run->firstSector + j;
+            uint8_t *src = ra->buf + (size_t) slot * DISKIMG_SECTOR_SIZE;
+            void *cached = lru_insert(cache, &sector, sizeof(sector), src, 1);
+            if (cached != NULL) {
+                lru_release(cache, cached);
+            }
+        }
+        ra->slotSector[slot] = -1;
+    }
+    run->count = 0;
+}
+
+/* Harvests finished runs, first waiting until at least minWait have
+   finished.  Returns the number harvested, or -1 on error.  Caller holds
+   fillLock.
+ */
+static int readahead_reap(struct readahead *ra, struct lru *cache, int minWait) {
+    struct diskimg_aio_completion done[ra->maxWindow];
+    int n = diskimg_aio_reap(ra->aio, done, ra->maxWindow, minWait);
+    for (int i = 0; i < n; i++) {
+        readahead_harvest(ra, cache, (int) (intptr_t) done[i].tag, done[i].result);
+    }
+    return n;
+}
+
+/* Returns the slot sector is being read into, or -1 if it isn't in
+   flight.  Caller holds fillLock.
+ */
+static int readahead_findslot(const struct readahead *ra, int sector) {
+    for (int i = 0; i < ra->maxWindow; i++) {
+        if (ra->slotSector[i] == sector) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void readahead_fill(struct readahead *ra, struct lru *cache,
+                    const int sectors[], int count) {
+    pthread_mutex_lock(&ra->fillLock);
+    if (ra->aio == NULL) {
+        ra->aio = diskimg_aio_create(ra->dfd, ra->maxWindow, DISKIMG_AIO_AUTO);
+    }
+    if (ra->aio != NULL && diskimg_aio_inflight(ra->aio) > 0) {
+        readahead_reap(ra, cache, 0);
+    }
+
+    // Group the sectors that are neither cached nor in flight into runs of
+    // adjacent ones, each in a block of free slots.
+    int newRuns[ra->maxWindow];
+    int numNew = 0;
+    int lastRun = -1;
+    int nextFree = 0;
+    for (int i = 0; i < count; i++) {
+        int sector = sectors[i];
+        if (sector <= 0 || lru_contains(cache, &sector, sizeof(sector)) ||
+            readahead_findslot(ra, sector) >= 0) {
+            continue;
+        }
+
+        struct readahead_run *run = lastRun >= 0 ? &ra->runs[lastRun] : NULL;
+        int slot = run != NULL ? run->firstSlot + run->count : ra->maxWindow;
+        if (run == NULL || run->firstSector + run->count != sector ||
+            slot >= ra->maxWindow || ra->slotSector[slot] != -1) {
+            // start a new run in the next free slot, if there is one
+            while (nextFree < ra->maxWindow && ra->slotSector[nextFree] != -1) {
+                nextFree++;
+            }
+            int r = 0;
+            while (r < ra->maxWindow && ra->runs[r].count > 0) {
+                r++;
+            }
+            if (nextFree >= ra->maxWindow || r >= ra->maxWindow) {
+                break;
+            }
+            ra->runs[r].firstSector = sector;
+            ra->runs[r].firstSlot = nextFree;
+            ra->runs[r].count = 0;
+            newRuns[numNew++] = r;
+            lastRun = r;
+            run = &ra->runs[r];
+            slot = nextFree;
+        }
+        ra->slotSector[slot] = sector;
+        ra->slotRun[slot] = lastRun;
+        run->count++;
+    }
+
+    // Send the new runs off without waiting for them.  Without a queue (or
+    // with a full one) a run is read synchronously instead.
+    for (int i = 0; i < numNew; i++) {
+        int r = newRuns[i];
+        struct readahead_run *run = &ra->runs[r];
+        uint8_t *dst = ra->buf + (size_t) run->firstSlot * DISKIMG_SECTOR_SIZE;
+        if (ra->aio == NULL ||
+            diskimg_aio_submit(ra->aio, run->firstSector, run->count, dst,
+                               (void *) (intptr_t) r) != 0) {
+            int bytes = diskimg_readsectors(ra->dfd, run->firstSector, run->count, dst);
+            readahead_harvest(ra, cache, r, bytes);
+        }
+    }
+    if (ra->aio != NULL && numNew > 0) {
+        diskimg_aio_flush(ra->aio);
+    }
+    pthread_mutex_unlock(&ra->fillLock);
+}
+
+int readahead_wait(struct readahead *ra, struct lru *cache, int sector) {
+    pthread_mutex_lock(&ra->fillLock);
+    int slot = readahead_findslot(ra, sector);
+    if (slot < 0) {
+        pthread_mutex_unlock(&ra->fillLock);
+        return 0;
+    }
+
+    // Reap until this sector's run is in; others that finish meanwhile are
+    // harvested too, but nothing waits for the rest of the window.
+    int r = ra->slotRun[slot];
+    while (ra->runs[r].count > 0) {
+        if (readahead_reap(ra, cache, 1) <= 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ra->fillLock);
+    return 1;
+}
+
+void readahead_free(struct readahead *ra) {
+    if (ra == NULL) {
+        return;
+    }
+    diskimg_aio_destroy(ra->aio);
+    free(ra->runs);
+    free(ra->slotRun);
+    free(ra->slotSector);
+    pthread_mutex_destroy(&ra->fillLock);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->buf);
+    free(ra);
+}
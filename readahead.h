@@ -0,0 +1,58 @@
+/* This file defines the sequential-readahead state kept by a filesystem.
+ * The file layer reports each block it reads; when a file is being read
+ * front to back, readahead_advise says which blocks to fetch ahead of the
+ * reader, and readahead_fill queues reads of them that carry on in the
+ * background while the reader goes on.  The window doubles each time the
+ * reader catches up to it, up to a fixed maximum.
+ *
+ * Readers are told apart by inumber only, so two readers of the same file
+ * share one stream: if they interleave, each looks like random access to
+ * the other and resets the window.  That only costs prefetching, never
+ * correctness.
+ */
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+struct lru;
+struct readahead;
+
+/**
+ * Creates readahead state for the disk image dfd that prefetches at most
+ * maxWindow blocks at a time.  Returns NULL on error.
+ */
+struct readahead *readahead_create(int dfd, int maxWindow);
+
+/**
+ * Records that block fileBlockIndex of file inumber (numBlocks blocks
+ * long) was just read.  If the reader is sequential and has reached the
+ * point where the next window should be fetched, stores the first file
+ * block index to prefetch at *start and returns the number of blocks;
+ * otherwise returns 0.
+ */
+int readahead_advise(struct readahead *ra, int inumber, int fileBlockIndex,
+                     int numBlocks, int *start);
+
+/**
+ * Starts reading whichever of the count sectors listed are neither cached
+ * nor already being read, merging adjacent sectors into single requests,
+ * and returns without waiting for them.  Reads that have finished by the
+ * next call, or that a reader waits for with readahead_wait, are copied
+ * into the cache.
+ */
+void readahead_fill(struct readahead *ra, struct lru *cache,
+                    const int sectors[], int count);
+
+/**
+ * If sector is being prefetched, waits for the read holding it (and no
+ * others) to finish, copies it into the cache and returns 1.  Returns 0 at
+ * once if sector isn't in flight.
+ */
+int readahead_wait(struct readahead *ra, struct lru *cache, int sector);
+
+/**
+ * Frees readahead state.
+ */
+void readahead_free(struct readahead *ra);
+
+#endif // _READAHEAD_H_
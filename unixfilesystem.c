@@ -1,7 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "unixfilesystem.h"
 #include "diskimg.h"
+#include "lru.h"
+#include "readahead.h"
+#include "inodetable.h"
+
+/* Destructor for caches whose values are a single malloc'd pointer. */
+static void free_pointee(void *value) {
+    free(*(void **) value);
+}
+
+void unixfilesystem_default_options(struct unixfilesystem_options *opts) {
+    opts->cacheSectors = UNIXFILESYSTEM_DEFAULT_CACHE_SECTORS;
+    opts->readaheadBlocks = UNIXFILESYSTEM_DEFAULT_READAHEAD_BLOCKS;
+    opts->inodeTable = UNIXFILESYSTEM_INODES_ONDEMAND;
+    opts->blockMapEntries = UNIXFILESYSTEM_DEFAULT_BLOCKMAP_ENTRIES;
+    opts->dirIndexEntries = UNIXFILESYSTEM_DEFAULT_DIRINDEX_ENTRIES;
+    opts->dentryEntries = UNIXFILESYSTEM_DEFAULT_DENTRY_ENTRIES;
+    opts->pathEntries = UNIXFILESYSTEM_DEFAULT_PATH_ENTRIES;
+}
 
 /**
  * Allocates and initializes a struct unixfilesystem given a filedescriptor to
@@ -10,6 +29,13 @@
  */
 
 struct unixfilesystem *unixfilesystem_init(int dfd) {
+    struct unixfilesystem_options opts;
+    unixfilesystem_default_options(&opts);
+    return unixfilesystem_init_options(dfd, &opts);
+}
+
+struct unixfilesystem *unixfilesystem_init_options(int dfd,
+        const struct unixfilesystem_options *opts) {
     // Validate the bootblock.  This will catch the situation where something
     // other than a descriptor to a valid diskimg is passed in.
     uint16_t bootblock[256];
@@ -36,6 +62,13 @@ struct unixfilesystem *unixfilesystem_init(int dfd) {
     }
 
     fs->dfd = dfd;
+    fs->sectorCache = NULL;
+    fs->readahead = NULL;
+    fs->inodeTable = NULL;
+    fs->blockMapCache = NULL;
+    fs->dirIndexCache = NULL;
+    fs->dentryCache = NULL;
+    fs->pathCache = NULL;
     if (diskimg_readsector(dfd, SUPERBLOCK_SECTOR, &fs->superblock)
             != DISKIMG_SECTOR_SIZE) {
         fprintf(stderr, "Error reading superblock\n");
@@ -43,5 +76,175 @@ struct unixfilesystem *unixfilesystem_init(int dfd) {
         return NULL;
     }
 
+    // A mapped image is already in memory, so caching it again only costs.
+    if (opts->cacheSectors > 0 && diskimg_getbackend(dfd) != DISKIMG_BACKEND_MMAP) {
+        fs->sectorCache = lru_create(opts->cacheSectors, DISKIMG_SECTOR_SIZE, NULL);
+        if (fs->sectorCache == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            free(fs);
+            return NULL;
+        }
+
+        // Prefetched blocks must survive in the cache until they're read.
+        int window = opts->readaheadBlocks;
+        if (window > opts->cacheSectors / 4) {
+            window = opts->cacheSectors / 4;
+        }
+        if (window > 0) {
+            fs->readahead = readahead_create(dfd, window);
+        }
+    }
+
+    if (opts->inodeTable != UNIXFILESYSTEM_INODES_ONDEMAND) {
+        int lazy = opts->inodeTable == UNIXFILESYSTEM_INODES_LAZY;
+        fs->inodeTable = inodetable_create(dfd, fs->superblock.s_isize, lazy);
+        if (fs->inodeTable == NULL) {
+            fprintf(stderr, "Error loading inode table\n");
+            unixfilesystem_free(fs);
+            return NULL;
+        }
+    }
+
+    if (opts->blockMapEntries > 0) {
+        fs->blockMapCache = lru_create(opts->blockMapEntries, sizeof(void *),
+                                       free_pointee);
+        if (fs->blockMapCache == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            unixfilesystem_free(fs);
+            return NULL;
+        }
+    }
+
+    if (opts->dirIndexEntries > 0) {
+        fs->dirIndexCache = lru_create(opts->dirIndexEntries, sizeof(void *),
+                                       free_pointee);
+        if (fs->dirIndexCache == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            unixfilesystem_free(fs);
+            return NULL;
+        }
+    }
+
+    // Both map to an inumber, or -1 for a name that doesn't exist.
+    if (opts->dentryEntries > 0) {
+        fs->dentryCache = lru_create(opts->dentryEntries, sizeof(int), NULL);
+        if (fs->dentryCache == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            unixfilesystem_free(fs);
+            return NULL;
+        }
+    }
+    if (opts->pathEntries > 0) {
+        fs->pathCache = lru_create(opts->pathEntries, sizeof(int), NULL);
+        if (fs->pathCache == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            unixfilesystem_free(fs);
+            return NULL;
+        }
+    }
+
     return fs;
 }
+
+/* Waits for sectorNum if it is still being prefetched, so that a sector
+   on its way in is neither read again nor counted as a miss.  Only the
+   caller's lookup afterwards counts as a cache hit or miss, since
+   lru_contains doesn't.
+ */
+static void unixfilesystem_awaitprefetch(const struct unixfilesystem *fs,
+                                         int sectorNum) {
+    if (fs->readahead != NULL &&
+        !lru_contains(fs->sectorCache, &sectorNum, sizeof(sectorNum))) {
+        readahead_wait(fs->readahead, fs->sectorCache, sectorNum);
+    }
+}
+
+int unixfilesystem_readsector(const struct unixfilesystem *fs, int sectorNum,
+                              void *buf) {
+    if (fs->sectorCache == NULL) {
+        return diskimg_readsector(fs->dfd, sectorNum, buf);
+    }
+
+    unixfilesystem_awaitprefetch(fs, sectorNum);
+    if (lru_get(fs->sectorCache, &sectorNum, sizeof(sectorNum), buf)) {
+        diskimg_recordcache(fs->dfd, 1);
+        return DISKIMG_SECTOR_SIZE;
+    }
+    diskimg_recordcache(fs->dfd, 0);
+
+    int bytes = diskimg_readsector(fs->dfd, sectorNum, buf);
+    if (bytes == DISKIMG_SECTOR_SIZE) {
+        void *cached = lru_insert(fs->sectorCache, &sectorNum, sizeof(sectorNum),
+                                  buf, 1);
+        if (cached != NULL) {
+            lru_release(fs->sectorCache, cached);
+        }
+    }
+    return bytes;
+}
+
+const void *unixfilesystem_getsector(const struct unixfilesystem *fs, int sectorNum) {
+    if (diskimg_getbackend(fs->dfd) == DISKIMG_BACKEND_MMAP) {
+        const void *sector = diskimg_getsectorptr(fs->dfd, sectorNum);
+        if (sector == NULL) {
+            fprintf(stderr, "Error reading sector %d\n", sectorNum);
+        }
+        return sector;
+    }
+
+    if (fs->sectorCache == NULL) {
+        void *copy = malloc(DISKIMG_SECTOR_SIZE);
+        if (copy == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            return NULL;
+        }
+        if (diskimg_readsector(fs->dfd, sectorNum, copy) != DISKIMG_SECTOR_SIZE) {
+            free(copy);
+            return NULL;
+        }
+        return copy;
+    }
+
+    unixfilesystem_awaitprefetch(fs, sectorNum);
+    const void *cached = lru_lookup(fs->sectorCache, &sectorNum, sizeof(sectorNum));
+    diskimg_recordcache(fs->dfd, cached != NULL);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    char buf[DISKIMG_SECTOR_SIZE];
+    if (diskimg_readsector(fs->dfd, sectorNum, buf) != DISKIMG_SECTOR_SIZE) {
+        return NULL;
+    }
+    cached = lru_insert(fs->sectorCache, &sectorNum, sizeof(sectorNum), buf, 1);
+    if (cached == NULL) {
+        fprintf(stderr,"Out of memory.\n");
+    }
+    return cached;
+}
+
+void unixfilesystem_releasesector(const struct unixfilesystem *fs, const void *sector) {
+    if (sector == NULL || diskimg_getbackend(fs->dfd) == DISKIMG_BACKEND_MMAP) {
+        return;
+    }
+    void *pinned = (void *) (uintptr_t) sector;
+    if (fs->sectorCache == NULL) {
+        free(pinned);
+    } else {
+        lru_release(fs->sectorCache, pinned);
+    }
+}
+
+void unixfilesystem_free(struct unixfilesystem *fs) {
+    if (fs == NULL) {
+        return;
+    }
+    lru_free(fs->pathCache);
+    lru_free(fs->dentryCache);
+    lru_free(fs->dirIndexCache);
+    lru_free(fs->blockMapCache);
+    inodetable_free(fs->inodeTable);
+    readahead_free(fs->readahead);
+    lru_free(fs->sectorCache);
+    free(fs);
+}
@@ -26,12 +26,112 @@
 #define ROOT_INUMBER        1
 #define BOOTBLOCK_MAGIC_NUM 0407
 
+// Sectors kept in the buffer cache when no options are given (256 KiB).
+#define UNIXFILESYSTEM_DEFAULT_CACHE_SECTORS 512
+
+// Largest number of blocks prefetched at once for a sequential reader.
+#define UNIXFILESYSTEM_DEFAULT_READAHEAD_BLOCKS 64
+
+// Block numbers kept in the per-file block map cache by default (128 KiB).
+#define UNIXFILESYSTEM_DEFAULT_BLOCKMAP_ENTRIES 65536
+
+// Directory entries kept in the per-directory name index by default.
+#define UNIXFILESYSTEM_DEFAULT_DIRINDEX_ENTRIES 16384
+
+// Names and full paths kept by pathname_lookup's caches by default.
+#define UNIXFILESYSTEM_DEFAULT_DENTRY_ENTRIES 16384
+#define UNIXFILESYSTEM_DEFAULT_PATH_ENTRIES   16384
+
+// Ways of keeping the inode table in memory (unixfilesystem_options).
+#define UNIXFILESYSTEM_INODES_ONDEMAND 0  // read inode sectors as needed
+#define UNIXFILESYSTEM_INODES_EAGER    1  // load the whole table at init
+#define UNIXFILESYSTEM_INODES_LAZY     2  // load it in chunks on first use
+
+struct lru;
+struct readahead;
+struct inodetable;
+
 struct unixfilesystem {
     int dfd;                     // File descriptor from the diskimg module to
                                  // read the disk image.
     struct filsys superblock;    // The superblock read from the disk image.
+    struct lru *sectorCache;     // Recently read sectors, shared by all the
+                                 // layers; NULL if caching is off.
+    struct readahead *readahead; // Sequential-read detection for the file
+                                 // layer; NULL if readahead is off.
+    struct inodetable *inodeTable;  // In-memory inode table, or NULL to
+                                 // read inodes through the cache.
+    struct lru *blockMapCache;   // Flattened block maps of large files,
+                                 // keyed by inumber; NULL if off.
+    struct lru *dirIndexCache;   // Name hash tables of directories, keyed
+                                 // by inumber; NULL if off.
+    struct lru *dentryCache;     // Results of looking up one name in one
+                                 // directory, misses included; NULL if off.
+    struct lru *pathCache;       // Results of looking up whole pathnames,
+                                 // misses included; NULL if off.
 };
 
+/**
+ * Tunables for unixfilesystem_init_options.
+ */
+struct unixfilesystem_options {
+    int cacheSectors;            // Capacity of the sector cache; 0 turns
+                                 // the cache off.
+    int readaheadBlocks;         // Largest readahead window, in blocks; 0
+                                 // turns readahead off.  Needs the cache,
+                                 // and is capped at a quarter of it.
+    int inodeTable;              // One of the UNIXFILESYSTEM_INODES_*
+                                 // values.
+    int blockMapEntries;         // Total block numbers held by the block map
+                                 // cache; 0 turns it off.
+    int dirIndexEntries;         // Total directory entries held by the
+                                 // directory index cache; 0 turns it off.
+    int dentryEntries;           // Capacity of the dentry cache; 0 turns
+                                 // it off.
+    int pathEntries;             // Capacity of the pathname cache; 0 turns
+                                 // it off.
+};
+
+/**
+ * Fills in *opts with the settings unixfilesystem_init uses.
+ */
+void unixfilesystem_default_options(struct unixfilesystem_options *opts);
+
 struct unixfilesystem *unixfilesystem_init(int fd);
 
+/**
+ * Like unixfilesystem_init, but with explicit options.
+ * Returns NULL on error.
+ */
+struct unixfilesystem *unixfilesystem_init_options(int fd,
+        const struct unixfilesystem_options *opts);
+
+/**
+ * Reads the specified sector through the filesystem's sector cache and
+ * stores it at buf.  Every layer reads the disk through this function.
+ * Returns the number of bytes read, or -1 on error.
+ */
+int unixfilesystem_readsector(const struct unixfilesystem *fs, int sectorNum,
+                              void *buf);
+
+/**
+ * Returns a read-only pointer to the contents of the specified sector
+ * without copying it out: into the mapping for a mapped image, or to the
+ * sector pinned in the cache.  With the cache off, the sector is read into
+ * a private copy.  The pointer stays valid until it is handed back with
+ * unixfilesystem_releasesector.  Returns NULL on error.
+ */
+const void *unixfilesystem_getsector(const struct unixfilesystem *fs, int sectorNum);
+
+/**
+ * Releases a sector returned by unixfilesystem_getsector.
+ */
+void unixfilesystem_releasesector(const struct unixfilesystem *fs, const void *sector);
+
+/**
+ * Frees a struct unixfilesystem and everything it caches.  Does not close
+ * the disk image.
+ */
+void unixfilesystem_free(struct unixfilesystem *fs);
+
 #endif // _UNIXFILESYSTEM_H_